@@ -19,14 +19,15 @@ void midi_dump(const midi::Midi &parsed_midi, std::string &path) {
     pm.GetFormat(), ntrks, pm.GetDivision(), pm.GetTicksPerQuarterNote());
   for (size_t itrack = 0; itrack < ntrks; ++itrack) {
     const midi::Track &track = pm.GetTracks()[itrack];
-    const std::vector<std::unique_ptr<midi::Event>> &events = track.events_;
+    const std::vector<midi::Event> &events = track.events_;
     const size_t ne = events.size();
     out << fmt::format("Track[{:2d}] #(events)={}", itrack, ne) << " {\n";
     uint32_t abs_time = 0;
     for (size_t ie = 0; ie < ne; ++ie) {
-      const midi::Event *e = events[ie].get();
-      abs_time += e->delta_time_;
-      out << fmt::format(" [{:4d}] AT={}, {}\n", ie, abs_time, e->dt_str());
+      const midi::Event &e = events[ie];
+      abs_time += e.delta_time_;
+      out << fmt::format(" [{:4d}] AT={}, {}\n", ie, abs_time,
+        track.EventDtStr(e));
     } 
     out << "}\n";
   }
@@ -0,0 +1,79 @@
+#include "filedata.h"
+#include <fstream>
+#include <iterator>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fmt/core.h>
+
+FileData::~FileData() {
+  Unload();
+}
+
+void FileData::Load(const std::string &path) {
+  Unload();
+  error_.clear();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    error_ = fmt::format("Cannot open: {}", path);
+  } else {
+    struct stat st;
+    bool mapped = (fstat(fd, &st) == 0) && S_ISREG(st.st_mode) &&
+      (st.st_size > 0) && Map(fd, st.st_size);
+    close(fd);
+    if (!mapped) {
+      Read(path);
+    }
+  }
+}
+
+void FileData::Assign(const uint8_t *data, size_t size) {
+  Unload();
+  error_.clear();
+  buffer_.assign(data, data + size);
+  SetBuffer();
+}
+
+void FileData::Unload() {
+  if (map_) {
+    munmap(map_, size_);
+    map_ = nullptr;
+  }
+  buffer_.clear();
+  data_ = nullptr;
+  size_ = 0;
+}
+
+bool FileData::Map(int fd, size_t file_size) {
+  // Beyond the file size, the last mapped page is zero filled.
+  // If that leaves less than padding, a buffer is used instead.
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  const size_t tail = file_size % page_size;
+  if ((tail != 0) && (page_size - tail >= padding)) {
+    void *p = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, file_size, MADV_SEQUENTIAL);
+      map_ = p;
+      data_ = static_cast<const uint8_t*>(map_);
+      size_ = file_size;
+    }
+  }
+  return map_ != nullptr;
+}
+
+void FileData::Read(const std::string &path) {
+  std::ifstream f(path, std::ios::binary);
+  buffer_.assign(
+    std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+  if (f.bad()) {
+    error_ = fmt::format("Failed to read {}", path);
+  }
+  SetBuffer();
+}
+
+void FileData::SetBuffer() {
+  size_ = buffer_.size();
+  buffer_.resize(size_ + padding, 0);
+  data_ = buffer_.data();
+}
@@ -0,0 +1,38 @@
+// -*- c++ -*-
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Read-only contents of a whole file.
+// Regular files are memory mapped, so the bytes are neither zero-filled
+// nor copied. Other files (pipes, devices) are read into an owned buffer.
+// At least padding zero bytes follow the data and can be read,
+// so parsers may overrun the end by a few bytes without bounds checks.
+class FileData {
+ public:
+  static constexpr size_t padding = 16;
+  FileData() {}
+  ~FileData();
+  void Load(const std::string &path);
+  void Assign(const uint8_t *data, size_t size); // copied
+  bool ok() const { return error_.empty(); }
+  const std::string &error() const { return error_; }
+  bool Mapped() const { return map_ != nullptr; }
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+  uint8_t operator[](size_t i) const { return data_[i]; }
+ private:
+  FileData(const FileData&) = delete;
+  FileData& operator=(const FileData&) = delete;
+  void Unload();
+  bool Map(int fd, size_t file_size);
+  void Read(const std::string &path);
+  void SetBuffer();
+  std::string error_;
+  void *map_{nullptr};
+  std::vector<uint8_t> buffer_; // fallback, if not mapped
+  const uint8_t *data_{nullptr};
+  size_t size_{0};
+};
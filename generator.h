@@ -0,0 +1,54 @@
+// -*- c++ -*-
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+// Minimal C++20 generator coroutine.
+// Each Next() resumes the body until its next co_yield,
+// and returns false once the body returned.
+template <typename T>
+class Generator {
+ public:
+  class promise_type {
+   public:
+    Generator get_return_object() {
+      return Generator{handle_t::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    std::suspend_always yield_value(T value) {
+      value_ = std::move(value);
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+    T value_{};
+  };
+  using handle_t = std::coroutine_handle<promise_type>;
+  Generator() {}
+  Generator(Generator &&other) :
+    handle_{std::exchange(other.handle_, nullptr)} {}
+  Generator &operator=(Generator &&other) {
+    std::swap(handle_, other.handle_);
+    return *this;
+  }
+  Generator(const Generator&) = delete;
+  ~Generator() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+  bool Next() {
+    if (handle_ && !handle_.done()) {
+      handle_.resume();
+    }
+    return handle_ && !handle_.done();
+  }
+  // Last yielded value
+  const T &Value() const { return handle_.promise().value_; }
+ private:
+  explicit Generator(handle_t handle) : handle_{handle} {}
+  handle_t handle_{nullptr};
+};
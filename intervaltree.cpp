@@ -0,0 +1,90 @@
+#include "intervaltree.h"
+#include <algorithm>
+
+void IntervalTree::Build(const std::vector<interval_t> &intervals) {
+  intervals_ = intervals;
+  nodes_.clear();
+  by_begin_.clear();
+  by_end_.clear();
+  std::vector<uint32_t> ids;
+  ids.reserve(intervals_.size());
+  for (uint32_t id = 0; id < intervals_.size(); ++id) {
+    if (intervals_[id][0] < intervals_[id][1]) {
+      ids.push_back(id);
+    }
+  }
+  by_begin_.reserve(ids.size());
+  by_end_.reserve(ids.size());
+  BuildNode(std::move(ids));
+}
+
+int32_t IntervalTree::BuildNode(std::vector<uint32_t> &&ids) {
+  int32_t inode = -1;
+  if (!ids.empty()) {
+    // Center at the median midpoint. That median interval contains it,
+    // so every node keeps at least one interval and recursion ends.
+    auto mid = [this](uint32_t id) {
+      const interval_t &interval = intervals_[id];
+      return interval[0] + (interval[1] - interval[0]) / 2;
+    };
+    auto median = ids.begin() + ids.size() / 2;
+    std::nth_element(ids.begin(), median, ids.end(),
+      [&mid](uint32_t id0, uint32_t id1) { return mid(id0) < mid(id1); });
+    const uint32_t center = mid(*median);
+    std::vector<uint32_t> left, right, here;
+    for (uint32_t id: ids) {
+      const interval_t &interval = intervals_[id];
+      if (interval[1] <= center) {
+        left.push_back(id);
+      } else if (center < interval[0]) {
+        right.push_back(id);
+      } else {
+        here.push_back(id);
+      }
+    }
+    ids = std::vector<uint32_t>();
+    inode = nodes_.size();
+    Node node;
+    node.center_ = center;
+    node.offset_ = by_begin_.size();
+    node.size_ = here.size();
+    nodes_.push_back(node);
+    std::sort(here.begin(), here.end(), [this](uint32_t id0, uint32_t id1) {
+      return intervals_[id0][0] < intervals_[id1][0];
+    });
+    by_begin_.insert(by_begin_.end(), here.begin(), here.end());
+    std::sort(here.begin(), here.end(), [this](uint32_t id0, uint32_t id1) {
+      return intervals_[id0][1] > intervals_[id1][1];
+    });
+    by_end_.insert(by_end_.end(), here.begin(), here.end());
+    const int32_t ileft = BuildNode(std::move(left));
+    nodes_[inode].left_ = ileft;
+    const int32_t iright = BuildNode(std::move(right));
+    nodes_[inode].right_ = iright;
+  }
+  return inode;
+}
+
+std::vector<uint32_t> IntervalTree::Stab(uint32_t t) const {
+  std::vector<uint32_t> ids;
+  int32_t inode = nodes_.empty() ? -1 : 0;
+  while (inode != -1) {
+    const Node &node = nodes_[inode];
+    const uint32_t *b = by_begin_.data() + node.offset_;
+    const uint32_t *e = by_end_.data() + node.offset_;
+    if (t < node.center_) {
+      for (uint32_t k = 0;
+          (k < node.size_) && (intervals_[b[k]][0] <= t); ++k) {
+        ids.push_back(b[k]);
+      }
+      inode = node.left_;
+    } else {
+      for (uint32_t k = 0;
+          (k < node.size_) && (t < intervals_[e[k]][1]); ++k) {
+        ids.push_back(e[k]);
+      }
+      inode = node.right_;
+    }
+  }
+  return ids;
+}
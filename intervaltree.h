@@ -0,0 +1,32 @@
+// -*- c++ -*-
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Centered interval tree over half open [begin, end) intervals.
+// Stab(t) gives the intervals containing t in O(log n + k).
+class IntervalTree {
+ public:
+  using interval_t = std::array<uint32_t, 2>; // [begin, end)
+  IntervalTree() {}
+  // Interval ids are their indices. Empty intervals are never found.
+  void Build(const std::vector<interval_t> &intervals);
+  bool empty() const { return nodes_.empty(); }
+  std::vector<uint32_t> Stab(uint32_t t) const; // ids, in no specific order
+ private:
+  class Node {
+   public:
+    uint32_t center_{0};
+    uint32_t offset_{0}; // of ids in by_begin_ and by_end_
+    uint32_t size_{0};
+    int32_t left_{-1};
+    int32_t right_{-1};
+  };
+  int32_t BuildNode(std::vector<uint32_t> &&ids);
+  std::vector<interval_t> intervals_;
+  std::vector<Node> nodes_; // root at 0
+  std::vector<uint32_t> by_begin_; // ids of each node's intervals
+  std::vector<uint32_t> by_end_; // as above, by descending end
+};
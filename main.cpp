@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <fmt/core.h>
 #include <fluidsynth.h>
@@ -8,9 +9,54 @@
 #include "synthseq.h"
 #include "version.h"
 
+// False, with an error message, if a track, channel, keys or kind is
+// invalid. Tracks are checked against the file tracks after parsing.
+static bool GetEventFilter(const Options &options, midi::EventFilter &filter) {
+  static constexpr unsigned max_tracks = 0x10000; // of 16 bits ntrks
+  bool ok = true;
+  const std::vector<unsigned> tracks = options.GetFilterTracks();
+  unsigned tracks_size = 0;
+  for (unsigned track: tracks) {
+    if (track < max_tracks) {
+      tracks_size = std::max(tracks_size, track + 1);
+    } else {
+      std::cerr << fmt::format("Invalid filter track: {}\n", track);
+      ok = false;
+    }
+  }
+  if (ok && !tracks.empty()) {
+    filter.tracks_.resize(tracks_size, false);
+    for (unsigned track: tracks) {
+      filter.tracks_[track] = true;
+    }
+  }
+  const std::vector<unsigned> channels = options.GetFilterChannels();
+  if (!channels.empty()) {
+    filter.channels_.reset();
+    for (unsigned channel: channels) {
+      if (channel < 0x10) {
+        filter.channels_.set(channel);
+      } else {
+        std::cerr << fmt::format("Invalid filter channel: {}\n", channel);
+        ok = false;
+      }
+    }
+  }
+  filter.keys_ = options.GetFilterKeys();
+  if (filter.keys_[0] > filter.keys_[1]) {
+    ok = false;
+  }
+  const std::vector<std::string> kinds = options.GetFilterKinds();
+  if (!kinds.empty()) {
+    ok = filter.SetKinds(kinds) && ok;
+  }
+  return ok;
+}
+
 int main(int argc, char **argv) {
   int rc = 0;
   Options options(argc, argv);
+  midi::EventFilter filter;
   if (options.Help()) {
     std::cout << options.Description();
   } else if (options.Version()) {
@@ -18,6 +64,8 @@ int main(int argc, char **argv) {
   } else if (!options.Valid()) {
     std::cerr << options.Description();
     rc = 1;
+  } else if (!GetEventFilter(options, filter)) {
+    rc = 1;
   } else {
     const uint32_t debug = options.Debug();
     if (debug) { 
@@ -25,10 +73,15 @@ int main(int argc, char **argv) {
         debug, options.BeginMillisec(), options.EndMillisec());
       std::cout << fmt::format("mf={}\n", options.MidifilePath());
     }
-    midi::Midi parsed_midi = midi::Midi(options.MidifilePath(), debug);
+    midi::Midi parsed_midi = midi::Midi(
+      options.MidifilePath(), debug, options.Threads(), filter);
     if (!parsed_midi.Valid()) {
       std::cerr << fmt::format("Midi error: {}\n", parsed_midi.GetError());
       rc = 1;
+    } else if (filter.tracks_.size() > parsed_midi.GetNumTracks()) {
+      std::cerr << fmt::format("Invalid filter track: {}, of {} tracks\n",
+        filter.tracks_.size() - 1, parsed_midi.GetNumTracks());
+      rc = 1;
     }
     if (rc == 0) {
       auto dump_path = options.DumpPath();
@@ -42,7 +95,8 @@ int main(int argc, char **argv) {
       }
     }
     if ((rc == 0) && options.Play()) {
-      SynthSequencer synth_sequencer(options.SoundfontsPath(), debug);
+      SynthSequencer synth_sequencer(options.SoundfontsPath(), debug,
+        options.Direct());
       if (synth_sequencer.ok()) {
         PlayParams pp;
         pp.begin_ms_ = options.BeginMillisec();
@@ -52,9 +106,18 @@ int main(int argc, char **argv) {
         pp.tuning_ = options.Tuning();
         pp.tracks_velocity_map_ = options.GetTracksVelocityMap();
         pp.channels_velocity_map_ = options.GetChannelsVelocityMap();
+        pp.muted_tracks_ = options.GetMutedTracks();
+        pp.muted_channels_ = options.GetMutedChannels();
+        pp.solo_tracks_ = options.GetSoloTracks();
+        pp.solo_channels_ = options.GetSoloChannels();
         pp.initial_delay_ms_ = options.DelayMillisec();
         pp.batch_duration_ms_ = options.BatchDurationMillisec();
+        pp.batch_max_events_ = options.BatchMaxEvents();
+        pp.batch_budget_us_ = options.BatchBudgetMicrosec();
         pp.progress_ = options.Progress();
+        pp.direct_ = options.Direct();
+        pp.lazy_ = options.Lazy() && !pp.direct_; // direct sorts all events
+        pp.threads_ = options.Threads();
         pp.debug_ = debug;
         play(parsed_midi, synth_sequencer, pp);
       } else {
@@ -1,8 +1,14 @@
 #include "midi.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <iostream>
 #include <fstream>
+#include <limits>
+#include <numeric>
 #include <set>
+#include <thread>
 #include <fmt/core.h>
 
 namespace fs = std::filesystem;
@@ -21,155 +27,256 @@ static void MaxBy(uint8_t &v, uint8_t x) {
   }
 }
 
-std::string Event::dt_str() const {
-  return fmt::format("DT={} {}", delta_time_, str());
-}
-
-// Meta Event
-
-std::string SequenceNumberEvent::str() const {
-  return fmt::format("SequenceNumber({})", number_);
-}
-
-std::string TextBaseEvent::str() const {
-  return fmt::format("{}({})", event_type_name(), s_);
-}
-
-std::string ChannelPrefixEvent::str() const {
-  return fmt::format("ChannelPrefix({})", channel_);
-}
-
-std::string PortEvent::str() const {
-  return fmt::format("PortEvent({})", port_);
-}
-
-std::string EndOfTrackEvent::str() const {
-  return fmt::format("EndOfTrack");
-}
-
-std::string TempoEvent::str() const {
-  return fmt::format("Tempo({})", tttttt_);
-}
-
-std::string SmpteOffsetEvent::str() const {
-  return fmt::format("SmpteOffset(hr={}, mn={}, se={}, fr={}, ff={})",
-    hr_, mn_, se_, fr_, ff_);
+// Classification of a track event by its first byte
+enum class EventClass : uint8_t { Running, Midi, SysEx, Meta, Invalid };
+
+class StatusInfo {
+ public:
+  EventClass class_{EventClass::Invalid};
+  uint8_t n_data_{0}; // data bytes of midi events
+};
+
+static constexpr std::array<StatusInfo, 0x100> MakeStatusTable() {
+  std::array<StatusInfo, 0x100> table{};
+  for (size_t b = 0; b < 0x100; ++b) {
+    StatusInfo &info = table[b];
+    const size_t upper4 = b >> 4;
+    if (b < 0x80) {
+      info.class_ = EventClass::Running;
+    } else if (upper4 < 0xf) {
+      info.class_ = EventClass::Midi;
+      info.n_data_ = ((upper4 == 0xc) || (upper4 == 0xd)) ? 1 : 2;
+    } else if ((b == 0xf0) || (b == 0xf7)) {
+      info.class_ = EventClass::SysEx;
+    } else if (b == 0xff) {
+      info.class_ = EventClass::Meta;
+    }
+  }
+  return table;
 }
 
-std::string TimeSignatureEvent::str() const {
-  return fmt::format("TimeSignature(nn={}, dd={}, cc={}, bb={})",
-    nn_, dd_, cc_, bb_);
-}
+static constexpr std::array<StatusInfo, 0x100> status_table =
+  MakeStatusTable();
 
-std::string KeySignatureEvent::str() const {
-  return fmt::format("KeySignatureEvent(sf={}, mi={})",
-    sf_, mi_);
+static const char *TextTypeName(EventKind kind) {
+  const char *name = "";
+  switch (kind) {
+   case EventKind::Text:
+    name = "Text";
+    break;
+   case EventKind::Copyright:
+    name = "Copyright";
+    break;
+   case EventKind::SequenceTrackName:
+    name = "SequenceTrackName";
+    break;
+   case EventKind::InstrumentName:
+    name = "InstrumentName";
+    break;
+   case EventKind::Lyric:
+    name = "Lyric";
+    break;
+   case EventKind::Marker:
+    name = "Marker";
+    break;
+   case EventKind::Device:
+    name = "Device";
+    break;
+   default:
+    break;
+  }
+  return name;
 }
 
-std::string SequencerEvent::str() const {
-  return fmt::format("Sequencer(#(data)={})", data_.size());
+std::string Track::EventStr(const Event &e) const {
+  std::string s;
+  // Fixed length meta payloads may have an unexpected length,
+  // only their size_ bytes are read, missing ones are shown as 0.
+  std::array<uint8_t, 5> p{};
+  if ((e.kind_ == EventKind::SmpteOffset) ||
+      (e.kind_ == EventKind::TimeSignature)) {
+    std::copy_n(Payload(e).data(), std::min<size_t>(e.size_, p.size()),
+      p.begin());
+  }
+  switch (e.kind_) {
+   // Meta Events
+   case EventKind::SequenceNumber:
+    s = fmt::format("SequenceNumber({})", e.value_);
+    break;
+   case EventKind::Text:
+   case EventKind::Copyright:
+   case EventKind::SequenceTrackName:
+   case EventKind::InstrumentName:
+   case EventKind::Lyric:
+   case EventKind::Marker:
+   case EventKind::Device:
+    s = fmt::format("{}({})", TextTypeName(e.kind_), Text(e));
+    break;
+   case EventKind::ChannelPrefix:
+    s = fmt::format("ChannelPrefix({})", e.channel_);
+    break;
+   case EventKind::Port:
+    s = fmt::format("PortEvent({})", e.data1_);
+    break;
+   case EventKind::EndOfTrack:
+    s = fmt::format("EndOfTrack");
+    break;
+   case EventKind::Tempo:
+    s = fmt::format("Tempo({})", e.Tempo());
+    break;
+   case EventKind::SmpteOffset:
+    s = fmt::format("SmpteOffset(hr={}, mn={}, se={}, fr={}, ff={})",
+      p[0], p[1], p[2], p[3], p[4]);
+    break;
+   case EventKind::TimeSignature:
+    s = fmt::format("TimeSignature(nn={}, dd={}, cc={}, bb={})",
+      p[0], p[1], p[2], p[3]);
+    break;
+   case EventKind::KeySignature:
+    s = fmt::format("KeySignatureEvent(sf={}, mi={})",
+      e.data1_, e.data2_ != 0);
+    break;
+   case EventKind::Sequencer:
+    s = fmt::format("Sequencer(#(data)={})", e.size_);
+    break;
+   // Midi Events
+   case EventKind::NoteOff:
+    s = fmt::format("NoteOff(channel={}, key={}, velocity={})",
+      e.channel_, e.Key(), e.Velocity());
+    break;
+   case EventKind::NoteOn:
+    s = fmt::format("NoteOn(channel={}, key={}, velocity={})",
+      e.channel_, e.Key(), e.Velocity());
+    break;
+   case EventKind::KeyPressure:
+    s = fmt::format("KeyPressure(channel={}, number={}, value={})",
+      e.channel_, e.data1_, e.data2_);
+    break;
+   case EventKind::ControlChange:
+    s = fmt::format("ControlChange(channel={}, number={}, value={})",
+      e.channel_, e.data1_, e.data2_);
+    break;
+   case EventKind::ProgramChange:
+    s = fmt::format("ProgramChange(channel={}, number={})",
+      e.channel_, e.Number());
+    break;
+   case EventKind::ChannelPressure:
+    s = fmt::format("ChannelPressure(channel={}, value={})",
+      e.channel_, e.data1_);
+    break;
+   case EventKind::PitchWheel:
+    s = fmt::format("PitchWheel(channel={}, bend={})", e.channel_, e.Bend());
+    break;
+   // System Exclusive
+   case EventKind::SysEx:
+    s = fmt::format("SysEx(#(data)={})", e.size_);
+    break;
+   case EventKind::SysExEscape:
+    s = fmt::format("SysExEscape(#(data)={})", e.size_);
+    break;
+   default:
+    s = fmt::format("Unknown(kind={:02x})", uint8_t(e.kind_));
+  }
+  return s;
 }
 
-// Midi Event
-std::string NoteOffEvent::str() const { 
-  return fmt::format("NoteOff(channel={}, key={}, velocity={})",
-    channel_, key_, velocity_);
-}
-std::string NoteOnEvent::str() const {
-  return fmt::format("NoteOn(channel={}, key={}, velocity={})",
-    channel_, key_, velocity_);
-}
-std::string KeyPressureEvent::str() const {
-  return fmt::format("KeyPressure(channel={}, number={}, value={})",
-    channel_, number_, value_);
-}
-std::string ControlChangeEvent::str() const {
-  return fmt::format("ControlChange(channel={}, number={}, value={})",
-    channel_, number_, value_);
-}
-std::string ProgramChangeEvent::str() const {
-  return fmt::format("ProgramChange(channel={}, number={})", channel_, number_);
-}
-std::string ChannelPressureEvent::str() const {
-  return fmt::format("ChannelPressure(channel={}, value={})", channel_, value_);
-}
-std::string PitchWheelEvent::str() const {
-  return fmt::format("ChannelPressure(channel={}, bend={})", channel_, bend_);
+std::string Track::EventDtStr(const Event &e) const {
+  return fmt::format("DT={} {}", e.delta_time_, EventStr(e));
 }
 
 ////////////////////////////////////////////////////////////////////////
 
-std::vector<uint8_t> Track::GetChannels() const {
-  std::set<uint8_t> channels;
-  for (const auto &e: events_) {
-    const NoteOnEvent *note_on = dynamic_cast<const NoteOnEvent*>(e.get());
-    if (note_on) {
-      channels.insert(channels.end(), note_on->channel_);
-    }
+void TrackStats::AddNoteOn(uint8_t channel, uint8_t key, uint8_t velocity) {
+  channels_.set(channel);
+  MinBy(key_range_[0], key);
+  MaxBy(key_range_[1], key);
+  if (velocity > 0) {
+    ++n_notes_;
+    MinBy(velocity_range_[0], velocity);
+    MaxBy(velocity_range_[1], velocity);
+    range_t &channel_range = channels_velocity_range_[channel];
+    MinBy(channel_range[0], velocity);
+    MaxBy(channel_range[1], velocity);
   }
-  return std::vector(channels.begin(), channels.end());
 }
 
-std::vector<uint8_t> Track::GetPrograms() const {
-  std::set<uint8_t> programs;
-  for (const auto &e: events_) {
-    const ProgramChangeEvent *prog_change =
-      dynamic_cast<const ProgramChangeEvent*>(e.get());
-    if (prog_change) {
-      programs.insert(programs.end(), prog_change->number_);
+void TrackStats::Merge(const TrackStats &other) {
+  channels_ |= other.channels_;
+  programs_ |= other.programs_;
+  MinBy(key_range_[0], other.key_range_[0]);
+  MaxBy(key_range_[1], other.key_range_[1]);
+  MinBy(velocity_range_[0], other.velocity_range_[0]);
+  MaxBy(velocity_range_[1], other.velocity_range_[1]);
+  for (size_t c = 0; c < channels_velocity_range_.size(); ++c) {
+    range_t &range = channels_velocity_range_[c];
+    MinBy(range[0], other.channels_velocity_range_[c][0]);
+    MaxBy(range[1], other.channels_velocity_range_[c][1]);
+  }
+  n_notes_ += other.n_notes_;
+}
+
+bool EventFilter::SetKinds(const std::vector<std::string> &names) {
+  static const std::unordered_map<std::string, std::vector<EventKind>>
+    name_kinds{
+      {"note", {EventKind::NoteOff, EventKind::NoteOn}},
+      {"keypressure", {EventKind::KeyPressure}},
+      {"control", {EventKind::ControlChange}},
+      {"program", {EventKind::ProgramChange}},
+      {"channelpressure", {EventKind::ChannelPressure}},
+      {"pitchwheel", {EventKind::PitchWheel}},
+      {"sysex", {EventKind::SysEx, EventKind::SysExEscape}},
+    };
+  bool ok = true;
+  for (size_t b = 0x80; b < 0x100; ++b) {
+    kinds_.reset(b);
+  }
+  for (const std::string &name: names) {
+    auto iter = name_kinds.find(name);
+    if (iter == name_kinds.end()) {
+      std::cerr << fmt::format("Unknown event kind: {}\n", name);
+      ok = false;
+    } else {
+      for (EventKind kind: iter->second) {
+        kinds_.set(uint8_t(kind));
+      }
     }
   }
-  return std::vector(programs.begin(), programs.end());
+  return ok;
 }
 
-std::array<uint8_t, 2> Track::GetKeyRange() const {
-  std::array<uint8_t, 2> range{0xff, 0};
-  for (const auto &e: events_) {
-    const NoteOnEvent *note_on = dynamic_cast<const NoteOnEvent*>(e.get());
-    if (note_on) {
-      uint8_t v = note_on->key_;
-      MinBy(range[0], v);
-      MaxBy(range[1], v);
+template <size_t N>
+static std::vector<uint8_t> BitsetToVector(const std::bitset<N> &bits) {
+  std::vector<uint8_t> v;
+  for (size_t i = 0; i < N; ++i) {
+    if (bits.test(i)) {
+      v.push_back(i);
     }
   }
-  return range;
+  return v;
 }
 
-std::array<uint8_t, 2> Track::GetVelocityRange() const {
-  std::array<uint8_t, 2> range{0xff, 0};
-  for (const auto &e: events_) {
-    const NoteOnEvent *note_on = dynamic_cast<const NoteOnEvent*>(e.get());
-    uint8_t v;
-    if (note_on && (v = note_on->velocity_) > 0) {
-      MinBy(range[0], v);
-      MaxBy(range[1], v);
-    }
-  }
-  return range;
+std::vector<uint8_t> Track::GetChannels() const {
+  return BitsetToVector(stats_.channels_);
+}
+
+std::vector<uint8_t> Track::GetPrograms() const {
+  return BitsetToVector(stats_.programs_);
 }
 
 std::string Track::info(const std::string& indent) const {
   std::string s;
-  size_t n_notes = 0;
-  for (const auto &e: events_) {
-    const MetaEvent *meta_event = dynamic_cast<const MetaEvent*>(e.get());
-    const MidiEvent *midi_event = dynamic_cast<const MidiEvent*>(e.get());
-    if (meta_event) {
-      if ((!dynamic_cast<const LyricEvent*>(meta_event)) &&
-          (!dynamic_cast<const EndOfTrackEvent*>(meta_event))) {
-        s = fmt::format("{}{}{}\n", s, indent, meta_event->str());
-      }
-    } else if (midi_event) {
-      const NoteOnEvent *note_on = dynamic_cast<const NoteOnEvent*>(midi_event);
-      if (note_on) {
-        if (note_on->velocity_ > 0) {
-          ++n_notes;
-        }
-      } else if (!dynamic_cast<const NoteOffEvent*>(midi_event)) {
-        s = fmt::format("{}{}{}\n", s, indent, midi_event->str());
-      }
+  for (const Event &e: events_) {
+    switch (e.kind_) {
+     case EventKind::Lyric:
+     case EventKind::EndOfTrack:
+     case EventKind::NoteOff:
+     case EventKind::NoteOn:
+      break;
+     default:
+      s = fmt::format("{}{}{}\n", s, indent, EventStr(e));
     }
   }
+  const size_t n_notes = stats_.n_notes_;
   if (n_notes == 0) {
     s = fmt::format("{}{}No notes\n", s, indent);
   } else {
@@ -188,7 +295,13 @@ std::string Track::info(const std::string& indent) const {
 
 ////////////////////////////////////////////////////////////////////////
 
-Midi::Midi(const std::string &midifile_path, uint32_t debug) :
+Midi::Midi(
+    const std::string &midifile_path,
+    uint32_t debug,
+    unsigned threads,
+    const EventFilter &filter) :
+  threads_{threads},
+  filter_{filter},
   debug_{debug} {
   GetData(midifile_path);
   if (Valid()) {
@@ -196,44 +309,36 @@ Midi::Midi(const std::string &midifile_path, uint32_t debug) :
   }
 }
 
-std::vector<uint8_t> Midi::GetChannels() const {
-  std::set<uint8_t> channels;
-  for (const Track& track: tracks_) {
-    std::vector<uint8_t> t_channels = track.GetChannels();
-    for (uint8_t c: t_channels) {
-      channels.insert(channels.end(), c);
-    }
+Midi::Midi(
+    const uint8_t *data,
+    size_t size,
+    uint32_t debug,
+    unsigned threads,
+    const EventFilter &filter) :
+  threads_{threads},
+  filter_{filter},
+  debug_{debug} {
+  data_.Assign(data, size);
+  CheckDataSize();
+  if (Valid()) {
+    Parse();
   }
-  return std::vector<uint8_t>(channels.begin(), channels.end()); 
+}
+
+std::vector<uint8_t> Midi::GetChannels() const {
+  return BitsetToVector(stats_.channels_);
 }
 
 std::vector<uint8_t> Midi::GetPrograms() const {
-  std::set<uint8_t> programs;
-  for (const Track& track: tracks_) {
-    std::vector<uint8_t> t_programs = track.GetPrograms();
-    for (uint8_t c: t_programs) {
-      programs.insert(programs.end(), c);
-    }
-  }
-  return std::vector<uint8_t>(programs.begin(), programs.end()); 
+  return BitsetToVector(stats_.programs_);
 }
 
 Midi::channels_range_t Midi::GetChannelsRange() const {
   channels_range_t channels_range;
-  for (const Track& track: tracks_) {
-    for (const auto &e: track.events_) {
-      const NoteOnEvent *note_on = dynamic_cast<const NoteOnEvent*>(e.get());
-      uint8_t v;
-      if (note_on && ((v = note_on->velocity_) > 0)) {
-        auto iter = channels_range.find(note_on->channel_);
-        if (iter == channels_range.end()) {
-          channels_range.insert({note_on->channel_, {v, v}});
-        } else {
-          range_t &range = iter->second;
-          MinBy(range[0], v);
-          MinBy(range[1], v);
-        }
-      }
+  for (size_t c = 0; c < stats_.channels_velocity_range_.size(); ++c) {
+    const range_t &range = stats_.channels_velocity_range_[c];
+    if (range[0] <= range[1]) {
+      channels_range.insert({c, range});
     }
   }
   return channels_range;
@@ -268,29 +373,32 @@ std::string Midi::info(const std::string& indent) const {
 
 void Midi::GetData(const std::string &midifile_path) {
   if (fs::exists(midifile_path)) {
-    auto file_size = fs::file_size(midifile_path);
-    if (debug_ & 0x1) {
-      std::cout << fmt::format("size({})={}\n", midifile_path, file_size);
-    }
-    if (file_size < 0x20) {
-      error_ = fmt::format("Midi file size={} too short", file_size);
+    data_.Load(midifile_path);
+    if (!data_.ok()) {
+      error_ = data_.error();
     }
-    if (Valid()) {
-      data_.clear();
-      data_.insert(data_.end(), file_size, 0);
-      std::ifstream f(midifile_path, std::ios::binary);
-      f.read(reinterpret_cast<char*>(data_.data()), file_size);
-      if (f.fail()) {
-        error_ = fmt::format("Failed to read {} bytes from {}",
-          file_size, midifile_path);
-      }
+    if (debug_ & 0x1) {
+      std::cout << fmt::format("size({})={} mapped={}\n",
+        midifile_path, data_.size(), data_.Mapped());
     }
+    CheckDataSize();
   } else {
     error_ = fmt::format("Does not exist: {}", midifile_path);
   }
 }
 
+void Midi::CheckDataSize() {
+  if (Valid() && (data_.size() < 0x20)) {
+    error_ = fmt::format("Midi file size={} too short", data_.size());
+  }
+  // Event::value_ holds payload offsets
+  if (Valid() && (data_.size() > std::numeric_limits<uint32_t>::max())) {
+    error_ = fmt::format("Midi file size={} too large", data_.size());
+  }
+}
+
 void Midi::Parse() {
+  auto t0 = std::chrono::steady_clock::now();
   ParseHeader();
   if (Valid()) {
     switch (format_) {
@@ -298,22 +406,27 @@ void Midi::Parse() {
        ReadOneTrack();
        break;
      case 1:
-       ReadTracks();
+       ReadTracks(ntrks_);
        break;
      default:
        error_ = fmt::format("Unsupported format={}", format_);
     }
   }
+  if (debug_ & 0x1) {
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+    std::cout << fmt::format("Parsed {} bytes in {:.3f}ms, {:.1f}MB/s\n",
+      data_.size(), 1000. * dt.count(), data_.size() / (1.e6 * dt.count()));
+  }
 }
 
 void Midi::ParseHeader() {
   static const std::string MThd{"MThd"};
-  const std::string header = GetChunkType();
+  const std::string_view header = GetChunkType(parse_state_);
   if (header != MThd) {
     error_ = fmt::format("header: {} != {}", header, MThd);
   }
   if (Valid()) {
-     size_t length = GetNextSize();
+     size_t length = GetNextSize(parse_state_);
      if (length != 6) {
        std::cerr << fmt::format("Unexpected length: {} != 6\n", length);
      }
@@ -344,71 +457,180 @@ void Midi::ParseHeader() {
   }
 }
 
-void Midi::ReadTracks() {
-  for (uint16_t itrack = 0; Valid() && (itrack < ntrks_); ++itrack) {
-    ReadTrack();
+std::vector<Midi::chunk_t> Midi::ScanTrackChunks(size_t ntracks) {
+  static const std::string MTrk{"MTrk"};
+  std::vector<chunk_t> chunks;
+  const size_t size = data_.size();
+  for (size_t itrack = 0; Valid() && (itrack < ntracks); ++itrack) {
+    if (parse_state_.offset_ + 8 > size) {
+      error_ = fmt::format("Missing track chunk #{} @ offset={} size={}",
+        itrack, parse_state_.offset_, size);
+    } else {
+      const std::string_view chunk_type = GetChunkType(parse_state_);
+      if (chunk_type != MTrk) {
+        error_ = fmt::format("chunk_type={} != {} @ offset={}",
+          chunk_type, MTrk, parse_state_.offset_ - 4);
+      } else {
+        size_t length = GetNextSize(parse_state_);
+        if (length > size - parse_state_.offset_) {
+          std::cerr << fmt::format("Track chunk #{} length={} truncated "
+            "to file size={}\n", itrack, length, size);
+          length = size - parse_state_.offset_;
+        }
+        chunks.push_back(
+          {parse_state_.offset_, parse_state_.offset_ + length});
+        parse_state_.offset_ += length;
+      }
+    }
   }
+  return chunks;
 }
 
-void Midi::ReadTrack() {
-  static const std::string MTrk{"MTrk"};
-  const std::string chunk_type = GetChunkType();
-  if (chunk_type != MTrk) {
-    error_ = fmt::format("chunk_type={} != {} @ offset={}",
-      chunk_type, MTrk, parse_state_.offset_ - 4);
-  }
-  const size_t length = GetNextSize();
-  const size_t offset_eot = parse_state_.offset_ + length;
-  tracks_.push_back(Track());
-  auto &events = tracks_.back().events_;
+void Midi::ReadTracks(size_t ntracks) {
+  const std::vector<chunk_t> chunks = ScanTrackChunks(ntracks);
+  const size_t nchunks = chunks.size();
+  const size_t nthreads = std::min<size_t>(threads_, nchunks);
+  if (debug_ & 0x1) {
+    std::cout << fmt::format("ReadTracks: {} chunks, {} threads\n",
+      nchunks, nthreads);
+  }
+  tracks_.resize(nchunks);
+  std::vector<ParseState> states(nchunks);
+  const bool trace = debug_ & 0x200;
+  auto read = [this, &chunks, &states, trace](size_t i) {
+    states[i].offset_ = chunks[i][0];
+    states[i].end_ = chunks[i][1];
+    states[i].keep_events_ = filter_.KeepsTrack(i);
+    tracks_[i].file_data_ = data_.data();
+    if (trace) {
+      ReadTrack<true>(states[i], tracks_[i]);
+    } else {
+      ReadTrack<false>(states[i], tracks_[i]);
+    }
+  };
+  if (nthreads <= 1) {
+    bool ok = true;
+    for (size_t i = 0; ok && (i < nchunks); ++i) {
+      read(i);
+      ok = states[i].error_.empty();
+    }
+  } else {
+    // Largest tracks first, for better balance
+    std::vector<size_t> order(nchunks);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&chunks](size_t i0, size_t i1) {
+      return chunks[i0][1] - chunks[i0][0] > chunks[i1][1] - chunks[i1][0];
+    });
+    std::atomic<size_t> next{0};
+    auto worker = [&read, &order, &next, nchunks]() {
+      for (size_t k = next++; k < nchunks; k = next++) {
+        read(order[k]);
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < nthreads; ++t) {
+      workers.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &w: workers) {
+      w.join();
+    }
+  }
+  for (size_t i = 0; Valid() && (i < nchunks); ++i) {
+    if (!states[i].error_.empty()) {
+      error_ = states[i].error_;
+      tracks_.resize(i + 1);
+    }
+  }
+  for (const Track &track: tracks_) {
+    stats_.Merge(track.stats_);
+  }
+}
+
+template <bool debug>
+void Midi::ReadTrack(ParseState &ps, Track &track) const {
+  // Events start within the chunk, and the longest fixed size event
+  // (delta time, meta type, length, and 4 data bytes) is shorter than
+  // the FileData padding, so only payload lengths need checking.
+  static_assert(4 + 1 + 1 + 4 + 4 <= FileData::padding);
+  auto &events = track.events_;
+  if (filter_.All()) {
+    events.reserve((ps.end_ - ps.offset_) / 4);
+  } // else grown by the kept events only
   bool got_eot = false;
-  while ((!got_eot) && (parse_state_.offset_ < offset_eot)) {
-    auto event = GetTrackEvent();
-    got_eot = (dynamic_cast<EndOfTrackEvent*>(event.get()) != nullptr);
-    events.push_back(std::move(event));
+  while ((!got_eot) && (ps.offset_ < ps.end_) && ps.error_.empty()) {
+    GetTrackEvent<debug>(ps, track);
+    got_eot = !events.empty() &&
+      (events.back().kind_ == EventKind::EndOfTrack);
   }
-  if ((!got_eot) || (parse_state_.offset_ != offset_eot)) {
+  if ((!got_eot) || (ps.offset_ != ps.end_)) {
     std::cerr << fmt::format(
       "Track not cleanly ended got_eot={}, offset={} != offset_eot={}\n",
-      got_eot, parse_state_.offset_, offset_eot);
+      got_eot, ps.offset_, ps.end_);
   }
-}
-
-std::unique_ptr<Event> Midi::GetTrackEvent() {
-  uint32_t delta_time = GetVariableLengthQuantity();
-  uint8_t event_first_byte = data_[parse_state_.offset_++];
-  std::unique_ptr<Event> e;
-  switch (event_first_byte) {
-   case 0xff:
-    e = GetMetaEvent(delta_time);
+  track.ticks_.reserve(events.size());
+  std::transform_inclusive_scan(
+    events.begin(), events.end(), std::back_inserter(track.ticks_),
+    std::plus<uint32_t>(),
+    [](const Event &e) { return e.delta_time_; });
+}
+
+template <bool debug>
+void Midi::GetTrackEvent(ParseState &ps, Track &track) const {
+  const size_t offset = ps.offset_;
+  const size_t n_events = track.events_.size();
+  uint32_t delta_time = GetVariableLengthQuantity(ps) + ps.pending_delta_time_;
+  ps.pending_delta_time_ = 0;
+  uint8_t event_first_byte = data_[ps.offset_++];
+  switch (status_table[event_first_byte].class_) {
+   case EventClass::Running:
+    --ps.offset_;
+    GetMidiEvent(ps, delta_time, ps.running_status_, track);
     break;
-   case 0xf0:
-   case 0xf7:
-     std::cerr << "Sysex Event ignored\n";
+   case EventClass::Midi:
+    ps.running_status_ = event_first_byte;
+    GetMidiEvent(ps, delta_time, event_first_byte, track);
     break;
-   default:
-    e = GetMidiEvent(delta_time, event_first_byte);
+   case EventClass::SysEx: {
+      size_t length = GetVariableLengthQuantity(ps);
+      GetPayloadEvent(ps, delta_time, event_first_byte, length, track);
+    }
+    break;
+   case EventClass::Meta:
+    GetMetaEvent(ps, delta_time, track);
+    break;
+   case EventClass::Invalid:
+    ps.error_ = fmt::format("Midi event unsupported status={:02x} @ {}",
+      event_first_byte, ps.offset_ - 1);
+  }
+  if constexpr (debug) {
+    if (track.events_.size() != n_events) {
+      std::cout << fmt::format("@{} {}\n",
+        offset, track.EventDtStr(track.events_.back()));
+    }
   }
-  return e;
 }
 
-std::unique_ptr<MetaEvent> Midi::GetMetaEvent(uint32_t delta_time) {
-  std::unique_ptr<MetaEvent> e;
+void Midi::GetMetaEvent(
+    ParseState &ps,
+    uint32_t delta_time,
+    Track &track) const {
+  auto &events = track.events_;
   uint32_t length;
-  std::string text;
-  uint8_t meta_first_byte = data_[parse_state_.offset_++];
+  uint8_t meta_first_byte = data_[ps.offset_++];
+  const EventKind kind = EventKind(meta_first_byte);
   switch (meta_first_byte) {
    case MetaVarByte::SEQNUM_x00:
-    length = data_[parse_state_.offset_++];
+    length = data_[ps.offset_++];
     if (length != 2) {
-      std::cerr << fmt::format("Unexpected length={}!=2 in SequenceNumber",
+      std::cerr << fmt::format("Unexpected length={}!=2 in SequenceNumber\n",
         length);
     }
     {
-      uint16_t number = GetU16from(parse_state_.offset_);
-      e = std::make_unique<SequenceNumberEvent>(delta_time, number);
+      uint16_t number = length >= 2 ? GetU16from(ps.offset_) : 0;
+      events.push_back(Event(delta_time, kind, 0, 0, 0, number));
     }
-    parse_state_.offset_ += length;
+    ps.offset_ += length;
    break;
    case MetaVarByte::TEXT_x01:
    case MetaVarByte::COPYRIGHT_x02:
@@ -417,229 +639,176 @@ std::unique_ptr<MetaEvent> Midi::GetMetaEvent(uint32_t delta_time) {
    case MetaVarByte::LYRICS_x05:
    case MetaVarByte::MARK_x06:
    case MetaVarByte::DEVICE_x09:
-    e = GetTextBaseEvent(delta_time, meta_first_byte);
+   case MetaVarByte::SEQUEMCER_x7f:
+    length = GetVariableLengthQuantity(ps);
+    GetPayloadEvent(ps, delta_time, meta_first_byte, length, track);
     break;
    case MetaVarByte::CHANPFX_x20:
-    length = GetVariableLengthQuantity();
+    length = GetVariableLengthQuantity(ps);
     if (length != 1) {
-      std::cerr << fmt::format("Unexpected length={}!=1 in ChannelPrefix",
+      std::cerr << fmt::format("Unexpected length={}!=1 in ChannelPrefix\n",
         length);
     }
-    e = std::make_unique<ChannelPrefixEvent>(
-      delta_time, data_[parse_state_.offset_]);
-    parse_state_.offset_ += length;
+    events.push_back(
+      Event(delta_time, kind, length > 0 ? data_[ps.offset_] : 0));
+    ps.offset_ += length;
     break;
    case MetaVarByte::PORT_x21:
-    length = GetVariableLengthQuantity();
+    length = GetVariableLengthQuantity(ps);
     if (length != 1) {
-      std::cerr << fmt::format("Unexpected length={}!=1 in ChannelPrefix",
+      std::cerr << fmt::format("Unexpected length={}!=1 in Port\n",
         length);
     }
-    e = std::make_unique<PortEvent>(delta_time, data_[parse_state_.offset_]);
-    parse_state_.offset_ += length;
+    events.push_back(
+      Event(delta_time, kind, 0, length > 0 ? data_[ps.offset_] : 0));
+    ps.offset_ += length;
     break;
    case MetaVarByte::ENDTRACK_x2f:
-    length = data_[parse_state_.offset_++];
+    length = data_[ps.offset_++];
     if (length != 0) {
-      std::cerr << fmt::format("Unexpected length={}!=0 in EndOfTrack",
+      std::cerr << fmt::format("Unexpected length={}!=0 in EndOfTrack\n",
         length);
     }
-    e = std::make_unique<EndOfTrackEvent>(delta_time);
-    parse_state_.offset_ += length;
+    events.push_back(Event(delta_time, kind));
+    ps.offset_ += length;
     break;
    case MetaVarByte::TEMPO_x51: {
-      auto tttttt = GetSizedQuantity();
-      e = std::make_unique<TempoEvent>(delta_time, tttttt);
+      auto tttttt = GetSizedQuantity(ps);
+      events.push_back(Event(delta_time, kind, 0, 0, 0, tttttt));
     }
     break;
    case MetaVarByte::SMPTE_x54:
-    length = data_[parse_state_.offset_++];
+    length = data_[ps.offset_++];
     if (length != 5) {
-      std::cerr << fmt::format("Unexpected length={}!=5 in Tempo",
+      std::cerr << fmt::format("Unexpected length={}!=5 in SmpteOffset\n",
         length);
     }
-    {
-      size_t offs = parse_state_.offset_;
-      e = std::make_unique<SmpteOffsetEvent>(
-        delta_time, 
-        data_[offs + 0],
-        data_[offs + 1],
-        data_[offs + 2],
-        data_[offs + 3],
-        data_[offs + 4]);
-    }
-    parse_state_.offset_ += length;
+    GetPayloadEvent(ps, delta_time, meta_first_byte, length, track);
     break;
    case MetaVarByte::TIMESIGN_x58:
-    length = data_[parse_state_.offset_++];
+    length = data_[ps.offset_++];
     if (length != 4) {
-      std::cerr << fmt::format("Unexpected length={}!=4 in TimeSignature",
+      std::cerr << fmt::format("Unexpected length={}!=4 in TimeSignature\n",
         length);
     }
-    {
-      size_t offs = parse_state_.offset_;
-      e = std::make_unique<TimeSignatureEvent>(
-        delta_time, 
-        data_[offs + 0],
-        data_[offs + 1],
-        data_[offs + 2],
-        data_[offs + 3]);
-    }
-    parse_state_.offset_ += length;
+    GetPayloadEvent(ps, delta_time, meta_first_byte, length, track);
     break;
    case MetaVarByte::KEYSIGN_x59:
-    length = data_[parse_state_.offset_++];
+    length = data_[ps.offset_++];
     if (length != 2) {
-      std::cerr << fmt::format("Unexpected length={}!=2 in KeySignature",
+      std::cerr << fmt::format("Unexpected length={}!=2 in KeySignature\n",
         length);
     }
     {
-      size_t offs = parse_state_.offset_;
-      e = std::make_unique<KeySignatureEvent>(
-        delta_time, data_[offs + 0], data_[offs + 1] != 0);
+      size_t offs = ps.offset_;
+      events.push_back(Event(delta_time, kind, 0,
+        length > 0 ? data_[offs + 0] : 0, length > 1 ? data_[offs + 1] : 0));
     }
-    parse_state_.offset_ += length;
-    break;
-   case MetaVarByte::SEQUEMCER_x7f:
-    length = GetVariableLengthQuantity();
-    {
-      std::vector<uint8_t>::const_iterator 
-        b = data_.begin() + parse_state_.offset_;
-      std::vector<uint8_t> data{b, b + length};
-      e = std::make_unique<SequencerEvent>(delta_time, data);
-    }
-    parse_state_.offset_ += length;
+    ps.offset_ += length;
     break;
    default:
-    error_ = fmt::format("Meta event unsupported byte={:02x} @ {}",
-      meta_first_byte, parse_state_.offset_ - 1);
-    length = GetVariableLengthQuantity();
-    parse_state_.offset_ += length;
+    ps.error_ = fmt::format("Meta event unsupported byte={:02x} @ {}",
+      meta_first_byte, ps.offset_ - 1);
+    length = GetVariableLengthQuantity(ps);
+    ps.offset_ += length;
   }
-  return e;
 }
 
-std::unique_ptr<MidiEvent> Midi::GetMidiEvent(
+void Midi::GetMidiEvent(
+    ParseState &ps,
     uint32_t delta_time,
-    uint8_t event_first_byte) {
-  std::unique_ptr<MidiEvent> e;
-  uint8_t upper4 = (event_first_byte >> 4) & 0xf;
-  if ((upper4 & 0x8) != 0) {
-    parse_state_.last_status_ = upper4 & 0x7;
-    parse_state_.last_channel_ = event_first_byte & 0xf;
-  } else {
-    --parse_state_.offset_; 
-  }
-  const size_t offs = parse_state_.offset_;
-  switch (parse_state_.last_status_) {
-   case MidiVarByte::NOTE_OFF_x0:
-    e = std::make_unique<NoteOffEvent>(
-      delta_time, parse_state_.last_channel_, data_[offs], data_[offs + 1]);
-    parse_state_.offset_ += 2;
-    break;
-   case MidiVarByte::NOTE_ON_x1:
-    e = std::make_unique<NoteOnEvent>(
-      delta_time, parse_state_.last_channel_, data_[offs], data_[offs + 1]);
-    parse_state_.offset_ += 2;
-    break;
-   case MidiVarByte::KEY_PRESSURE_x2:
-    e = std::make_unique<KeyPressureEvent>(
-      delta_time, parse_state_.last_channel_, data_[offs], data_[offs + 1]);
-    parse_state_.offset_ += 2;
-    break;
-   case MidiVarByte::CONTROL_CHANGE_x3:
-    e = std::make_unique<ControlChangeEvent>(
-      delta_time, parse_state_.last_channel_, data_[offs], data_[offs + 1]);
-    parse_state_.offset_ += 2;
-    break;
-   case MidiVarByte::PROGRAM_CHANGE_x4:
-    e = std::make_unique<ProgramChangeEvent>(
-      delta_time, parse_state_.last_channel_, data_[offs]);
-    parse_state_.offset_ += 1;
-    break;
-   case MidiVarByte::CHANNEL_PRESSURE_x5:
-    e = std::make_unique<ChannelPressureEvent>(
-      delta_time, parse_state_.last_channel_, data_[offs]);
-    parse_state_.offset_ += 1;
-    break;
-   case MidiVarByte::PITCH_WHEEL_x6: {
-      uint16_t lllllll = data_[offs] & 0x7f;
-      uint16_t mmmmmmm = data_[offs + 1] & 0x7f;
-      uint16_t bend = (mmmmmmm << 7) | lllllll;
-      e = std::make_unique<PitchWheelEvent>(
-        delta_time, parse_state_.last_channel_, bend);
+    uint8_t status,
+    Track &track) const {
+  const size_t offs = ps.offset_;
+  const uint8_t n_data = status_table[status].n_data_;
+  const EventKind kind = EventKind(status & 0xf0);
+  const uint8_t channel = status & 0xf;
+  const uint8_t data1 = data_[offs];
+  const uint8_t data2 = n_data == 2 ? data_[offs + 1] : 0;
+  if (ps.keep_events_ && filter_.Keeps(kind, channel, data1)) {
+    uint32_t value = 0;
+    switch (kind) {
+     case EventKind::NoteOn:
+      track.stats_.AddNoteOn(channel, data1, data2);
+      break;
+     case EventKind::ProgramChange:
+      track.stats_.AddProgram(data1);
+      break;
+     case EventKind::PitchWheel:
+      value = (uint32_t{data2 & 0x7fu} << 7) | (data1 & 0x7fu); // bend
+      break;
+     default:
+      break;
     }
-    break;
+    track.events_.push_back(
+      Event(delta_time, kind, channel, data1, data2, value));
+  } else {
+    ps.pending_delta_time_ = delta_time;
   }
-  return e;
+  ps.offset_ += n_data;
 }
 
-std::unique_ptr<TextBaseEvent> Midi::GetTextBaseEvent(
+void Midi::GetPayloadEvent(
+    ParseState &ps,
     uint32_t delta_time,
-    uint8_t meta_first_byte) {
-  std::unique_ptr<TextBaseEvent> e;
-  uint32_t length = GetVariableLengthQuantity();
-  auto text = GetString(length);
-  switch (meta_first_byte) {
-   case MetaVarByte::TEXT_x01:
-    e = std::make_unique<TextEvent>(delta_time, text);
-    break;
-   case MetaVarByte::COPYRIGHT_x02:
-    e = std::make_unique<CopyrightEvent>(delta_time, text);
-    break;
-   case MetaVarByte::TRACKNAME_x03:
-    e = std::make_unique<SequenceTrackNameEvent>(delta_time, text);
-    break;
-   case MetaVarByte::INSTRNAME_x04:
-    e = std::make_unique<InstrumentNameEvent>(delta_time, text);
-    break;
-   case MetaVarByte::LYRICS_x05:
-    e = std::make_unique<LyricEvent>(delta_time, text);
-    break;
-   case MetaVarByte::MARK_x06:
-    e = std::make_unique<MarkerEvent>(delta_time, text);
-    break;
-   case MetaVarByte::DEVICE_x09:
-    e = std::make_unique<DeviceEvent>(delta_time, text);
-    break;
-   default:
-    error_ = fmt::format("BUG meta_first_byte={:0x2}", meta_first_byte);
+    uint8_t kind_byte,
+    size_t length,
+    Track &track) const {
+  const EventKind kind = EventKind(kind_byte);
+  if (ps.offset_ + length > ps.end_) {
+    ps.error_ = fmt::format("Event length={} exceeds track end={} @ {}",
+      length, ps.end_, ps.offset_);
+  } else if (uint8_t(kind) >= 0xf0 &&
+      !(ps.keep_events_ && filter_.KeepsSysEx(kind))) {
+    ps.pending_delta_time_ = delta_time;
+  } else {
+    track.events_.push_back(
+      Event(delta_time, kind, 0, 0, 0, ps.offset_, length));
   }
-  return e;
+  ps.offset_ += length;
 }
 
-size_t Midi::GetNextSize() {
-  const size_t offs = parse_state_.offset_;
+size_t Midi::GetNextSize(ParseState &ps) const {
+  const size_t offs = ps.offset_;
   size_t sz = 0;
   for (size_t i = 0; i < 4; ++i) {
     size_t b{data_[offs + i]};
     sz = (sz << 8) | b;
   }
-  parse_state_.offset_ += 4;
+  ps.offset_ += 4;
   return sz;
 }
 
-size_t Midi::GetSizedQuantity() {
-  const size_t n_bytes = data_[parse_state_.offset_++];
+size_t Midi::GetSizedQuantity(ParseState &ps) const {
+  size_t n_bytes = data_[ps.offset_++];
+  if ((n_bytes > 4) || (ps.offset_ + n_bytes > ps.end_)) {
+    ps.error_ = fmt::format("Sized quantity of {} bytes @ {}",
+      n_bytes, ps.offset_ - 1);
+    n_bytes = 0;
+  }
   size_t quantity = 0;
   for (size_t i = 0; i < n_bytes; ++i) {
-    size_t b{data_[parse_state_.offset_++]};
+    size_t b{data_[ps.offset_++]};
     quantity = (quantity << 8) | b;
   }
   return quantity;
 }
 
-size_t Midi::GetVariableLengthQuantity() {
+size_t Midi::GetVariableLengthQuantity(ParseState &ps) const {
   size_t quantity = 0;
-  size_t offs = parse_state_.offset_;
-  const size_t ofss_limit = offs + 4;
-  bool done = false;
-  while ((offs < ofss_limit) && !done) {
-    size_t b = data_[offs++];
-    quantity = (quantity << 7) + (b & 0x7f);
-    done = (b & 0x80) == 0;
-  }
-  parse_state_.offset_ = offs;
+  size_t offs = ps.offset_;
+  if (data_[offs] < 0x80) { // most delta times are single byte
+    quantity = data_[offs++];
+  } else {
+    const size_t ofss_limit = offs + 4;
+    bool done = false;
+    while ((offs < ofss_limit) && !done) {
+      size_t b = data_[offs++];
+      quantity = (quantity << 7) + (b & 0x7f);
+      done = (b & 0x80) == 0;
+    }
+  }
+  ps.offset_ = offs;
   return quantity;
 }
 
@@ -648,10 +817,11 @@ uint16_t Midi::GetU16from(size_t from) const {
   return ret;
 }
 
-std::string Midi::GetString(size_t length) {
-  const size_t offs = parse_state_.offset_;
-  std::string s{&data_[offs], &data_[offs + length]};
-  parse_state_.offset_ += length;
+std::string_view Midi::GetString(ParseState &ps, size_t length) const {
+  const size_t offs = ps.offset_;
+  const char *b = reinterpret_cast<const char*>(data_.data()) + offs;
+  std::string_view s{b, length};
+  ps.offset_ += length;
   return s;
 }
 
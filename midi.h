@@ -2,11 +2,14 @@
 #pragma once
 
 #include <array>
+#include <bitset>
 #include <cstdint>
-#include <memory>
+#include <span>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
+#include "filedata.h"
 
 namespace midi {
 
@@ -42,333 +45,153 @@ enum MidiVarByte : uint8_t {
 class ParseState {
  public:
   size_t offset_{0};
-  uint8_t last_status_{0};
-  uint8_t last_channel_{0};
+  size_t end_{0}; // of the track chunk
+  uint8_t running_status_{0x80}; // NoteOff channel 0, if none given
+  bool keep_events_{true}; // false if the track is filtered out
+  uint32_t pending_delta_time_{0}; // of filtered out events
+  std::string error_;
 };
 
+// Event::kind_ tag, for switch based dispatch.
+// Meta event kinds are their MetaVarByte,
+// midi event kinds are their status byte with the channel masked out.
+enum class EventKind : uint8_t {
+  SequenceNumber    = MetaVarByte::SEQNUM_x00,
+  Text              = MetaVarByte::TEXT_x01,
+  Copyright         = MetaVarByte::COPYRIGHT_x02,
+  SequenceTrackName = MetaVarByte::TRACKNAME_x03,
+  InstrumentName    = MetaVarByte::INSTRNAME_x04,
+  Lyric             = MetaVarByte::LYRICS_x05,
+  Marker            = MetaVarByte::MARK_x06,
+  Device            = MetaVarByte::DEVICE_x09,
+  ChannelPrefix     = MetaVarByte::CHANPFX_x20,
+  Port              = MetaVarByte::PORT_x21,
+  EndOfTrack        = MetaVarByte::ENDTRACK_x2f,
+  Tempo             = MetaVarByte::TEMPO_x51,
+  SmpteOffset       = MetaVarByte::SMPTE_x54,
+  TimeSignature     = MetaVarByte::TIMESIGN_x58,
+  KeySignature      = MetaVarByte::KEYSIGN_x59,
+  Sequencer         = MetaVarByte::SEQUEMCER_x7f,
+  NoteOff           = 0x80 | (MidiVarByte::NOTE_OFF_x0 << 4),
+  NoteOn            = 0x80 | (MidiVarByte::NOTE_ON_x1 << 4),
+  KeyPressure       = 0x80 | (MidiVarByte::KEY_PRESSURE_x2 << 4),
+  ControlChange     = 0x80 | (MidiVarByte::CONTROL_CHANGE_x3 << 4),
+  ProgramChange     = 0x80 | (MidiVarByte::PROGRAM_CHANGE_x4 << 4),
+  ChannelPressure   = 0x80 | (MidiVarByte::CHANNEL_PRESSURE_x5 << 4),
+  PitchWheel        = 0x80 | (MidiVarByte::PITCH_WHEEL_x6 << 4),
+  SysEx             = 0xf0,
+  SysExEscape       = 0xf7,
+};
+
+// Compact fixed size record of a parsed event.
+// Variable length payloads (text, sequencer data, ...) are not copied,
+// value_ and size_ address them within the midi file data.
 class Event {
  public:
-  Event(uint32_t delta_time) : delta_time_{delta_time} {}
-  virtual ~Event() {}
-  std::string dt_str() const;
-  virtual std::string str() const = 0;
+  Event(
+    uint32_t delta_time=0,
+    EventKind kind=EventKind::SequenceNumber,
+    uint8_t channel=0,
+    uint8_t data1=0,
+    uint8_t data2=0,
+    uint32_t value=0,
+    uint32_t size=0) :
+      delta_time_{delta_time},
+      kind_{kind},
+      channel_{channel},
+      data1_{data1},
+      data2_{data2},
+      value_{value},
+      size_{size} {}
+  bool IsMeta() const { return uint8_t(kind_) < 0x80; }
+  bool IsMidi() const { return !IsMeta() && (uint8_t(kind_) < 0xf0); }
+  bool IsSysEx() const {
+    return (kind_ == EventKind::SysEx) || (kind_ == EventKind::SysExEscape);
+  }
+  uint8_t Key() const { return data1_; }
+  uint8_t Velocity() const { return data2_; }
+  uint8_t Number() const { return data1_; }
+  uint16_t Bend() const { return value_; }
+  uint32_t Tempo() const { return value_; }
   uint32_t delta_time_;
-};
-
-class MetaEvent : public Event {
- public:
-  MetaEvent(uint32_t dt) : Event{dt} {}
-  virtual ~MetaEvent() {}
-  virtual MetaVarByte VarByte() const = 0;
-};
-
-class MidiEvent : public Event {
- public:
-  MidiEvent(uint32_t dt) : Event{dt} {}
-  virtual ~MidiEvent() {}
-  virtual MidiVarByte VarByte() const = 0;
-};
-
-////////////////////////////////////////////////////////////////////////
-// Meta Events
-
-class SequenceNumberEvent : public MetaEvent { // 0xff 0x01
- public:
-  SequenceNumberEvent(uint32_t dt, uint16_t number) :
-    MetaEvent{dt},
-    number_{number_} {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::SEQNUM_x00; }
-  std::string str() const;
-  uint16_t number_;
-};
-
-class TextBaseEvent : public MetaEvent {
- public:
-  TextBaseEvent(uint32_t dt, const std::string& s="") : MetaEvent{dt}, s_{s} {}
-  virtual ~TextBaseEvent() {}
-  virtual std::string str() const;
-  virtual std::string event_type_name() const = 0;
-  std::string s_;
-};
-
-class TextEvent : public TextBaseEvent { // 0xff 0x01
- public:
-  TextEvent(uint32_t dt, const std::string& s="") : TextBaseEvent{dt, s} {}
-  virtual ~TextEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::TEXT_x01; }
-  std::string event_type_name() const { return "Text"; }
-};
-
-class CopyrightEvent : public TextBaseEvent { // 0xff 0x02
- public:
-  CopyrightEvent(uint32_t dt, const std::string& s="") : TextBaseEvent{dt, s} {}
-  virtual ~CopyrightEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::COPYRIGHT_x02; }
-  std::string event_type_name() const { return "Copyright"; }
-};
-
-class SequenceTrackNameEvent : public TextBaseEvent { // 0xff 0x03
- public:
-  SequenceTrackNameEvent(uint32_t dt, const std::string& s="") :
-    TextBaseEvent{dt, s} {}
-  virtual ~SequenceTrackNameEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::TRACKNAME_x03; }
-  std::string event_type_name() const { return "SequenceTrackName"; }
-};
-
-class InstrumentNameEvent : public TextBaseEvent { // 0xff 0x04
- public:
-  InstrumentNameEvent(uint32_t dt, const std::string& s="") :
-    TextBaseEvent{dt, s} {}
-  virtual ~InstrumentNameEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::INSTRNAME_x04; }
-  std::string event_type_name() const { return "InstrumentName"; }
-};
-
-class LyricEvent : public TextBaseEvent { // 0xff 0x05
- public:
-  LyricEvent(uint32_t dt, const std::string& s="") : TextBaseEvent{dt, s} {}
-  virtual ~LyricEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::LYRICS_x05; }
-  std::string event_type_name() const { return "Lyric"; }
-};
-
-class MarkerEvent : public TextBaseEvent { // 0xff 0x06
- public:
-  MarkerEvent(unsigned dt, const std::string& s="") : TextBaseEvent{dt, s} {}
-  virtual ~MarkerEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::MARK_x06; }
-  std::string event_type_name() const { return "Marker"; }
-};
-
-class DeviceEvent : public TextBaseEvent { // 0xff 0x09
- public:
-  DeviceEvent(uint32_t dt, const std::string& s="") : TextBaseEvent{dt, s} {}
-  virtual ~DeviceEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::DEVICE_x09; }
-  std::string event_type_name() const { return "Device"; }
-};
-
-class ChannelPrefixEvent : public MetaEvent { // 0xff 0x20
- public:
-  ChannelPrefixEvent(uint32_t dt, uint8_t channel) :
-    MetaEvent{dt}, channel_{channel} {}
-  virtual ~ChannelPrefixEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::CHANPFX_x20; }
-  std::string str() const;
+  EventKind kind_;
   uint8_t channel_;
+  uint8_t data1_; // key, controller or program number
+  uint8_t data2_; // velocity or value
+  uint32_t value_; // tempo, bend, sequence number or payload file offset
+  uint32_t size_; // payload size
 };
 
-class PortEvent : public MetaEvent { // 0xff 0x21
- public:
-  PortEvent(uint32_t dt, uint8_t port) : MetaEvent{dt}, port_{port} {}
-  virtual ~PortEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::PORT_x21; }
-  std::string str() const;
-  uint8_t port_;
-};
-
-class EndOfTrackEvent : public MetaEvent { // 0xff 0x2f
- public:
-  EndOfTrackEvent(uint32_t dt) : MetaEvent{dt}  {}
-  virtual ~EndOfTrackEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::ENDTRACK_x2f; }
-  std::string str() const;
-};
-
-class TempoEvent : public MetaEvent { // 0xff 0x51
- public:
-  TempoEvent(uint32_t dt, uint32_t tttttt) : MetaEvent{dt}, tttttt_{tttttt}  {}
-  virtual ~TempoEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::TEMPO_x51; }
-  std::string str() const;
-  uint32_t tttttt_;
-};
-
-class SmpteOffsetEvent : public MetaEvent { // 0xff 0x54
- public:
-  SmpteOffsetEvent(
-    uint32_t dt,
-    uint8_t hr,
-    uint8_t mn,
-    uint8_t se,
-    uint8_t fr,
-    uint8_t ff) :
-     MetaEvent{dt}, hr_{hr}, mn_{mn}, se_{se}, fr_{fr}, ff_{ff} {}
-  virtual ~SmpteOffsetEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::SMPTE_x54; }
-  std::string str() const;
-  uint8_t hr_;
-  uint8_t mn_;
-  uint8_t se_;
-  uint8_t fr_;
-  uint8_t ff_;
-};
-
-class TimeSignatureEvent : public MetaEvent { // 0xff 0x58
- public:
-  TimeSignatureEvent(
-    uint32_t dt,
-    uint8_t nn,
-    uint8_t dd,
-    uint8_t cc,
-    uint8_t bb) :
-    MetaEvent{dt}, nn_{nn}, dd_{dd}, cc_{cc}, bb_{bb} {}
-  virtual ~TimeSignatureEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::TIMESIGN_x58; }
-  std::string str() const;
-  uint8_t nn_;
-  uint8_t dd_;
-  uint8_t cc_;
-  uint8_t bb_;
-};
-
-class KeySignatureEvent : public MetaEvent { // 0xff 0x59
- public:
-  KeySignatureEvent(uint32_t dt, uint16_t sf, bool mi) :
-    MetaEvent{dt}, sf_{sf}, mi_{mi} {}
-  virtual ~KeySignatureEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::KEYSIGN_x59; }
-  std::string str() const;
-  uint16_t sf_;
-  bool mi_;
-};
-
-class SequencerEvent : public MetaEvent { // 0xff 0x7f
- public:
-  SequencerEvent(uint32_t dt, const std::vector<uint8_t> &data) :
-    MetaEvent{dt}, data_{data} {}
-  virtual ~SequencerEvent() {}
-  virtual MetaVarByte VarByte() const { return MetaVarByte::SEQUEMCER_x7f; }
-  std::string str() const;
-  std::vector<uint8_t> data_;
-};
-
-// End of Meta Events
-////////////////////////////////////////////////////////////////////////
-
-////////////////////////////////////////////////////////////////////////
-// Midi Events
-
-class NoteOffEvent : public MidiEvent {
- public:
-  NoteOffEvent(
-    unsigned dt,
-    uint8_t channel,
-    uint8_t key,
-    uint8_t velocity) :
-      MidiEvent(dt), channel_{channel}, key_{key}, velocity_{velocity} {}
-  virtual ~NoteOffEvent() {}
-  virtual MidiVarByte VarByte() const { return MidiVarByte::NOTE_OFF_x0; }
-  virtual std::string str() const;
-  uint8_t channel_{0};
-  uint8_t key_{0};
-  uint8_t velocity_{0}; // Should be zero
-};
-
-class NoteOnEvent : public MidiEvent {
- public:
-  NoteOnEvent(
-    unsigned dt,
-    uint8_t channel,
-    uint8_t key,
-    uint8_t velocity) :
-      MidiEvent(dt), channel_{channel}, key_{key}, velocity_{velocity} {}
-  virtual ~NoteOnEvent() {}
-  virtual MidiVarByte VarByte() const { return MidiVarByte::NOTE_ON_x1; }
-  virtual std::string str() const;
-  uint8_t channel_{0};
-  uint8_t key_{0};
-  uint8_t velocity_{0};
-};
-
-class KeyPressureEvent : public MidiEvent {
- public:
-  KeyPressureEvent(
-    unsigned dt,
-    uint8_t channel,
-    uint8_t number,
-    uint8_t value) :
-      MidiEvent(dt), channel_{channel}, number_{number}, value_{value} {}
-  virtual ~KeyPressureEvent() {}
-  virtual MidiVarByte VarByte() const { return MidiVarByte::KEY_PRESSURE_x2; }
-  virtual std::string str() const;
-  uint8_t channel_{0};
-  uint8_t number_{0};
-  uint8_t value_{0};
-};
-
-class ControlChangeEvent : public MidiEvent {
- public:
-  ControlChangeEvent(
-    unsigned dt,
-    uint8_t channel,
-    uint8_t number,
-    uint8_t value) :
-      MidiEvent(dt), channel_{channel}, number_{number}, value_{value} {}
-  virtual ~ControlChangeEvent() {}
-  virtual MidiVarByte VarByte() const { return MidiVarByte::CONTROL_CHANGE_x3; }
-  virtual std::string str() const;
-  uint8_t channel_{0};
-  uint8_t number_{0};
-  uint8_t value_{0};
-};
-
-class ProgramChangeEvent : public MidiEvent {
- public:
-  ProgramChangeEvent(
-    unsigned dt,
-    uint8_t channel,
-    uint8_t number) :
-      MidiEvent(dt), channel_{channel}, number_{number} {}
-  virtual ~ProgramChangeEvent() {}
-  virtual MidiVarByte VarByte() const { return MidiVarByte::PROGRAM_CHANGE_x4; }
-  virtual std::string str() const;
-  uint8_t channel_{0};
-  uint8_t number_{0};
-};
-
-class ChannelPressureEvent : public MidiEvent {
+// Parse time selection of midi and sysex events.
+// Meta events carry the timing and the tracks structure, and are kept.
+class EventFilter {
  public:
-  ChannelPressureEvent(
-    unsigned dt,
-    uint8_t channel,
-    uint8_t value) :
-      MidiEvent(dt), channel_{channel}, value_{value} {}
-  virtual ~ChannelPressureEvent() {}
-  virtual MidiVarByte VarByte() const {
-    return MidiVarByte::CHANNEL_PRESSURE_x5;
+  using range_t = std::array<uint8_t, 2>;
+  EventFilter() {
+    channels_.set();
+    kinds_.set();
+  }
+  // Keep only the named kinds: note, keypressure, control, program,
+  // channelpressure, pitchwheel, sysex. False if a name is unknown.
+  bool SetKinds(const std::vector<std::string> &names);
+  bool KeepsTrack(size_t track) const {
+    return tracks_.empty() || ((track < tracks_.size()) && tracks_[track]);
+  }
+  bool Keeps(EventKind kind, uint8_t channel, uint8_t key) const {
+    const bool keyed = uint8_t(kind) <= uint8_t(EventKind::KeyPressure);
+    return kinds_.test(uint8_t(kind)) && channels_.test(channel) &&
+      (!keyed || ((keys_[0] <= key) && (key <= keys_[1])));
   }
-  virtual std::string str() const;
-  uint8_t channel_{0};
-  uint8_t value_{0};
+  bool KeepsSysEx(EventKind kind) const { return kinds_.test(uint8_t(kind)); }
+  bool All() const {
+    return tracks_.empty() && channels_.all() && kinds_.all() &&
+      (keys_ == range_t{0, 0xff});
+  }
+  std::vector<bool> tracks_; // empty for all
+  std::bitset<0x10> channels_;
+  range_t keys_{0, 0xff}; // of notes and key pressure
+  std::bitset<0x100> kinds_; // by EventKind value, metas are always set
 };
 
-class PitchWheelEvent : public MidiEvent {
+// Notes and programs statistics, gathered while parsing
+class TrackStats {
  public:
-  PitchWheelEvent(
-    unsigned dt,
-    uint8_t channel,
-    uint16_t bend) :
-      MidiEvent(dt), channel_{channel}, bend_{bend} {}
-  virtual ~PitchWheelEvent() {}
-  virtual MidiVarByte VarByte() const { return MidiVarByte::PITCH_WHEEL_x6; }
-  virtual std::string str() const;
-  uint8_t channel_{0};
-  uint16_t bend_{0};
-};
-
-// End of Midi Events
-////////////////////////////////////////////////////////////////////////
-
+  using range_t = std::array<uint8_t, 2>; // empty if range[0] > range[1]
+  TrackStats() { channels_velocity_range_.fill(range_t{0xff, 0}); }
+  void AddNoteOn(uint8_t channel, uint8_t key, uint8_t velocity);
+  void AddProgram(uint8_t program) { programs_.set(program); }
+  void Merge(const TrackStats &other);
+  std::bitset<0x10> channels_; // of NoteOn events
+  std::bitset<0x100> programs_;
+  range_t key_range_{0xff, 0};
+  range_t velocity_range_{0xff, 0}; // ignoring zero velocity
+  std::array<range_t, 0x10> channels_velocity_range_;
+  size_t n_notes_{0}; // NoteOn events with positive velocity
+};
+
+// Payload views refer to the file data owned by the Midi that parsed
+// the track, and are valid as long as that Midi object lives.
 class Track {
  public:
-  std::vector<std::unique_ptr<Event>> events_;
+  std::vector<Event> events_;
+  std::vector<uint32_t> ticks_; // absolute time of each event
+  const uint8_t *file_data_{nullptr};
+  TrackStats stats_;
+  std::span<const uint8_t> Payload(const Event &e) const {
+    return {file_data_ + e.value_, e.size_};
+  }
+  std::string_view Text(const Event &e) const {
+    return {reinterpret_cast<const char*>(file_data_) + e.value_, e.size_};
+  }
+  std::string EventStr(const Event &e) const;
+  std::string EventDtStr(const Event &e) const;
   std::vector<uint8_t> GetChannels() const;
   std::vector<uint8_t> GetPrograms() const;
   // empty range if range[0] > range[1]
-  std::array<uint8_t, 2> GetKeyRange() const;
-  std::array<uint8_t, 2> GetVelocityRange() const;
+  std::array<uint8_t, 2> GetKeyRange() const { return stats_.key_range_; }
+  std::array<uint8_t, 2> GetVelocityRange() const {
+    return stats_.velocity_range_;
+  }
   std::string info(const std::string &indent="") const;
 };
 
@@ -376,7 +199,19 @@ class Midi {
  public:
   using range_t = std::array<uint8_t, 2>;
   using channels_range_t = std::unordered_map<uint8_t, range_t>;
-  Midi(const std::string &path, uint32_t debug=0);
+  // threads > 1: track chunks are parsed concurrently
+  Midi(
+    const std::string &path,
+    uint32_t debug=0,
+    unsigned threads=1,
+    const EventFilter &filter=EventFilter());
+  // In memory midi file contents, copied
+  Midi(
+    const uint8_t *data,
+    size_t size,
+    uint32_t debug=0,
+    unsigned threads=1,
+    const EventFilter &filter=EventFilter());
   std::string GetError() const { return error_; }
   bool Valid() const { return error_.empty(); }
   uint16_t GetFormat() const { return format_; }
@@ -392,31 +227,45 @@ class Midi {
   std::string info(const std::string& indent="") const;
   
  private:
-  using vu8_t = std::vector<uint8_t>;
   Midi() = delete;
   Midi(const Midi&) = delete;
   void GetData(const std::string &path);
+  void CheckDataSize();
   void Parse();
   void ParseHeader();
-  void ReadOneTrack() { ReadTrack(); }
-  void ReadTracks();
-  void ReadTrack();
-  std::unique_ptr<Event> GetTrackEvent();
-  std::unique_ptr<MetaEvent> GetMetaEvent(uint32_t delta_time);
-  std::unique_ptr<MidiEvent> GetMidiEvent(
+  using chunk_t = std::array<size_t, 2>; // [begin, end) of track events
+  // Chunks are validated to be within the data, so events are parsed
+  // without per byte bounds checks, only payload lengths are checked.
+  void ReadOneTrack() { ReadTracks(1); }
+  std::vector<chunk_t> ScanTrackChunks(size_t ntracks);
+  void ReadTracks(size_t ntracks);
+  // debug: trace every parsed event, other instances have no debug checks
+  template <bool debug>
+  void ReadTrack(ParseState &ps, Track &track) const;
+  template <bool debug>
+  void GetTrackEvent(ParseState &ps, Track &track) const;
+  void GetMetaEvent(ParseState &ps, uint32_t delta_time, Track &track) const;
+  void GetMidiEvent(
+    ParseState &ps,
     uint32_t delta_time,
-    uint8_t event_first_byte);
-  std::unique_ptr<TextBaseEvent> GetTextBaseEvent(
+    uint8_t status,
+    Track &track) const;
+  void GetPayloadEvent(
+    ParseState &ps,
     uint32_t delta_time,
-    uint8_t meta_first_byte);
-  size_t GetNextSize();
-  size_t GetSizedQuantity();
-  size_t GetVariableLengthQuantity();
+    uint8_t kind_byte,
+    size_t length,
+    Track &track) const;
+  size_t GetNextSize(ParseState &ps) const;
+  size_t GetSizedQuantity(ParseState &ps) const;
+  size_t GetVariableLengthQuantity(ParseState &ps) const;
   uint16_t GetU16from(size_t from) const;
-  std::string GetString(size_t length);
-  std::string GetChunkType() { return GetString(4); }
+  std::string_view GetString(ParseState &ps, size_t length) const;
+  std::string_view GetChunkType(ParseState &ps) const {
+    return GetString(ps, 4);
+  }
   std::string error_;
-  vu8_t data_;
+  FileData data_;
   ParseState parse_state_;
 
   uint16_t format_{0};
@@ -428,7 +277,10 @@ class Midi {
   uint16_t ticks_per_frame_{0};
 
   std::vector<Track> tracks_;
+  TrackStats stats_; // of all tracks
 
+  const unsigned threads_;
+  const EventFilter filter_;
   const uint32_t debug_;
 };
 
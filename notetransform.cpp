@@ -0,0 +1,108 @@
+#include "notetransform.h"
+#include <bitset>
+#include <iostream>
+#include <numeric>
+#include <fmt/core.h>
+
+class Affine {
+ public:
+  using range_t = std::array<uint8_t, 2>;
+  Affine(const range_t& source, const range_t &target) :
+    s0_{source[0]},
+    t0_{target[0]},
+    ds_{uint32_t{source[1]} - s0_},
+    dt_{uint32_t{target[1]} - t0_} {
+  }
+  uint8_t Map(uint8_t s) const {
+    uint32_t t = t0_ + (ds_ != 0 ? ((uint32_t(s) - s0_)*dt_)/ds_ : dt_/2);
+    return static_cast<uint8_t>(t);
+  }
+ private:
+  uint32_t s0_;
+  uint32_t t0_;
+  uint32_t ds_;
+  uint32_t dt_;
+};
+
+void NoteTransform::Build(const midi::Midi &pm, const PlayParams &pp) {
+  const size_t nt = pm.GetTracks().size();
+
+  std::bitset<0x10> channels_played;
+  if (pp.solo_channels_.empty()) {
+    channels_played.set();
+  }
+  for (unsigned channel: pp.solo_channels_) {
+    if (channel < 0x10) {
+      channels_played.set(channel);
+    }
+  }
+  for (unsigned channel: pp.muted_channels_) {
+    if (channel < 0x10) {
+      channels_played.reset(channel);
+    }
+  }
+  std::vector<bool> tracks_played(nt, pp.solo_tracks_.empty());
+  for (unsigned track: pp.solo_tracks_) {
+    if (track < nt) {
+      tracks_played[track] = true;
+    }
+  }
+  for (unsigned track: pp.muted_tracks_) {
+    if (track < nt) {
+      tracks_played[track] = false;
+    }
+  }
+
+  for (size_t channel = 0; channel < 0x10; ++channel) {
+    for (size_t key = 0; key < 0x100; ++key) {
+      const int shifted = int(uint8_t(key + pp.key_shift_));
+      keys_[channel][key] = channels_played.test(channel) && (shifted < 0x80)
+        ? shifted : dropped;
+    }
+  }
+
+  velocity_tables_.assign(1, table_t{});
+  std::iota(velocity_tables_[0].begin(), velocity_tables_[0].end(), 0);
+  std::array<uint16_t, 0x10> channels_vti;
+  channels_vti.fill(0);
+  auto const &cmap = pp.channels_velocity_map_;
+  if (!cmap.empty()) {
+    if (pp.debug_ & 0x1) {std::cerr<<fmt::format("#(cmap)={}\n", cmap.size());}
+    for (auto const &[channel, orig_range]: pm.GetChannelsRange()) {
+      auto iter = cmap.find(channel);
+      if (iter != cmap.end()) {
+        channels_vti[channel] = AddVelocityTable(orig_range, iter->second);
+      }
+    }
+  }
+  auto const &tmap = pp.tracks_velocity_map_;
+  if (pp.debug_ & 0x1) {
+    if (!tmap.empty()) {std::cerr<<fmt::format("#(tmap)={}\n", tmap.size());}
+  }
+  velocity_table_index_.resize(nt);
+  for (size_t ti = 0; ti < nt; ++ti) {
+    uint16_t track_vti = 0;
+    auto iter = tmap.find(ti);
+    if ((ti <= 0xff) && (iter != tmap.end())) {
+      track_vti = AddVelocityTable(
+        pm.GetTracks()[ti].GetVelocityRange(), iter->second);
+    }
+    // --cmap takes precedence
+    for (size_t channel = 0; channel < 0x10; ++channel) {
+      velocity_table_index_[ti][channel] = !tracks_played[ti] ? muted
+        : (channels_vti[channel] != 0 ? channels_vti[channel] : track_vti);
+    }
+  }
+}
+
+uint16_t NoteTransform::AddVelocityTable(
+    const std::array<uint8_t, 2> &source,
+    const std::array<uint8_t, 2> &target) {
+  const Affine affine{source, target};
+  const uint16_t vti = velocity_tables_.size();
+  velocity_tables_.push_back(table_t{});
+  for (size_t velocity = 0; velocity < 0x100; ++velocity) {
+    velocity_tables_[vti][velocity] = affine.Map(velocity);
+  }
+  return vti;
+}
@@ -0,0 +1,43 @@
+// -*- c++ -*-
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include "midi.h"
+#include "play.h"
+
+// Per note modifications of the play parameters: key shift, tracks and
+// channels velocity maps, mute and solo. Compiled once into dense tables,
+// so Apply needs no hashing nor division, and is safe to call concurrently.
+class NoteTransform {
+ public:
+  NoteTransform() {}
+  void Build(const midi::Midi &pm, const PlayParams &pp);
+  // Returns false if the note is not played,
+  // otherwise maps key and velocity in place.
+  bool Apply(
+      uint16_t track,
+      uint8_t channel,
+      uint8_t &key,
+      uint8_t &velocity) const {
+    const uint16_t vti = velocity_table_index_[track][channel];
+    const uint8_t k = keys_[channel][key];
+    const bool played = (vti != muted) && (k != dropped);
+    if (played) {
+      key = k;
+      velocity = velocity_tables_[vti][velocity];
+    }
+    return played;
+  }
+ private:
+  using table_t = std::array<uint8_t, 0x100>;
+  static constexpr uint8_t dropped = 0xff;
+  static constexpr uint16_t muted = 0xffff;
+  uint16_t AddVelocityTable(
+    const std::array<uint8_t, 2> &source,
+    const std::array<uint8_t, 2> &target);
+  std::array<table_t, 0x10> keys_; // [channel][key], shifted or dropped
+  std::vector<table_t> velocity_tables_; // [0] is the identity
+  std::vector<std::array<uint16_t, 0x10>> velocity_table_index_; // [track]
+};
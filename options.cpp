@@ -3,6 +3,7 @@
 #include <iostream>
 #include <limits>
 #include <sstream>
+#include <thread>
 #include <fmt/core.h>
 #include <boost/program_options.hpp>
 #include "version.h"
@@ -146,6 +147,7 @@ std::ostream& operator<<(std::ostream& os, const U8ToRange& u2r) {
 
 class _OptionsImpl {
  public:
+  using range_t = Options::range_t;
   using k2range_t = Options::k2range_t;
   _OptionsImpl(int argc, char **argv) :
     desc_{fmt::format(
@@ -186,10 +188,18 @@ class _OptionsImpl {
   std::string DumpPath() const { return vm_["dump"].as<std::string>(); }
   bool Play() const { return !(vm_["noplay"].as<bool>()); }
   bool Progress() const { return vm_["progress"].as<bool>(); }
+  bool Lazy() const { return vm_["lazy"].as<bool>(); }
+  bool Direct() const { return vm_["direct"].as<bool>(); }
   uint32_t BeginMillisec() const { return GetMilli("begin"); }
   uint32_t EndMillisec() const { return GetMilli("end"); }
   uint32_t DelayMillisec() const { return GetMilli("delay"); }
   uint32_t BatchDurationMillisec() const { return GetMilli("batch-duration"); }
+  uint32_t BatchMaxEvents() const {
+    return vm_["batch-events"].as<uint32_t>();
+  }
+  uint32_t BatchBudgetMicrosec() const {
+    return vm_["batch-budget"].as<uint32_t>();
+  }
   float Tempo() const {
     static float tempo_min = 1./8.;
     static float tempo_max = 8;
@@ -214,6 +224,13 @@ class _OptionsImpl {
     }
     return v;
   }
+  unsigned Threads() const {
+    unsigned v = vm_["threads"].as<unsigned>();
+    if (v == 0) {
+      v = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return v;
+  }
   int8_t KeyShift() const {
     int raw = vm_["adjust-key"].as<int>();
     int8_t key_shift{0};
@@ -230,6 +247,44 @@ class _OptionsImpl {
   k2range_t GetChannelsVelocityMap() const {
     return GetKeysVelocityMap("cmap");
   }
+  std::vector<unsigned> GetMutedTracks() const { return GetNumbers("tmute"); }
+  std::vector<unsigned> GetMutedChannels() const {
+    return GetNumbers("cmute");
+  }
+  std::vector<unsigned> GetSoloTracks() const { return GetNumbers("tsolo"); }
+  std::vector<unsigned> GetSoloChannels() const {
+    return GetNumbers("csolo");
+  }
+  std::vector<unsigned> GetFilterTracks() const {
+    return GetNumbers("filter-tracks");
+  }
+  std::vector<unsigned> GetFilterChannels() const {
+    return GetNumbers("filter-channels");
+  }
+  range_t GetFilterKeys() const {
+    range_t range{0, 0xff};
+    if (vm_.count("filter-keys") > 0) {
+      const std::string s = vm_["filter-keys"].as<std::string>();
+      const size_t comma = s.find(',');
+      const int low = StrToInt(s.substr(0, comma), -1);
+      const int high = comma == std::string::npos
+        ? low : StrToInt(s.substr(comma + 1), -1);
+      if ((0 <= low) && (low <= high) && (high <= 0x7f)) {
+        range = {uint8_t(low), uint8_t(high)};
+      } else {
+        std::cerr << fmt::format("Bad filter-keys {}\n", s);
+        range = {0xff, 0};
+      }
+    }
+    return range;
+  }
+  std::vector<std::string> GetFilterKinds() const {
+    std::vector<std::string> kinds;
+    if (vm_.count("filter-kinds") > 0) {
+      kinds = vm_["filter-kinds"].as<std::vector<std::string>>();
+    }
+    return kinds;
+  }
   uint32_t Debug() const {
     auto raw = vm_["debug"].as<std::string>();
     uint32_t flags = std::stoi(raw, nullptr, 0);
@@ -262,6 +317,13 @@ class _OptionsImpl {
     }
     return k2vel;
   }
+  std::vector<unsigned> GetNumbers(const char *name) const {
+    std::vector<unsigned> numbers;
+    if (vm_.count(name) > 0) {
+      numbers = vm_[name].as<std::vector<unsigned>>();
+    }
+    return numbers;
+  }
   po::options_description desc_;
   po::positional_options_description pos_desc_;
   po::variables_map vm_;
@@ -286,7 +348,16 @@ void _OptionsImpl::AddOptions() {
       "Initial extra playing delay in [minutes]:seconds[.millisecs]")
     ("batch-duration", 
       po::value<OptionMilliSec>()->default_value(OptionMilliSec{true, 10000}),
-      "sequencer batch duration in [minutes]:seconds[.millisecs]")
+      "sequencer batch duration in [minutes]:seconds[.millisecs], "
+      "stretched up to 8 times while batches have fewer than 256 events")
+    ("batch-events",
+       po::value<uint32_t>()->default_value(4096),
+       "Maximal number of events sent per batch, 0 for no limit. "
+       "Remaining events are sent on the next tick, even if due")
+    ("batch-budget",
+       po::value<uint32_t>()->default_value(2000),
+       "Time budget of sending a batch in microseconds, 0 for no limit. "
+       "Remaining events are sent on the next tick, even if due")
     ("tempo,T",
        po::value<float>()->default_value(1.),
        "Speed Multiplier factor")
@@ -302,16 +373,49 @@ void _OptionsImpl::AddOptions() {
     ("cmap",
        po::value<std::vector<U8ToRange>>()->multitoken(),
        "Channels velocity mappings <track>:<low>[,<high>]")
+    ("tmute",
+       po::value<std::vector<unsigned>>()->multitoken(),
+       "Tracks not to be played")
+    ("cmute",
+       po::value<std::vector<unsigned>>()->multitoken(),
+       "Channels not to be played")
+    ("tsolo",
+       po::value<std::vector<unsigned>>()->multitoken(),
+       "Tracks to be played, others are muted")
+    ("csolo",
+       po::value<std::vector<unsigned>>()->multitoken(),
+       "Channels to be played, others are muted")
+    ("filter-tracks",
+       po::value<std::vector<unsigned>>()->multitoken(),
+       "Parse channel events of these tracks only")
+    ("filter-channels",
+       po::value<std::vector<unsigned>>()->multitoken(),
+       "Parse events of these channels only")
+    ("filter-keys",
+       po::value<std::string>(),
+       "Parse notes within <low>[,<high>] keys only")
+    ("filter-kinds",
+       po::value<std::vector<std::string>>()->multitoken(),
+       "Parse these event kinds only: note keypressure control program "
+       "channelpressure pitchwheel sysex")
     ("soundfont,s",
        po::value<std::string>()->default_value(
          "/usr/share/sounds/sf2/FluidR3_GM.sf2"),
        "Path to sound fonts file")
+    ("threads",
+       po::value<unsigned>()->default_value(1),
+       "Number of worker threads for parsing and events generation, "
+       "0 for all cores")
     ("info", po::bool_switch()->default_value(false),
        "print general information of the midi file")
     ("dump", po::value<std::string>()->default_value(""),
        "Dump midi contents to file, '-' for stdout")
     ("noplay", po::bool_switch()->default_value(false), "Suppress playing")
     ("progress", po::bool_switch()->default_value(false), "show progress")
+    ("lazy", po::bool_switch()->default_value(false),
+       "Generate sequencer events per batch, while playing")
+    ("direct", po::bool_switch()->default_value(false),
+       "Render the synth with events at their samples, no sequencer")
     ("debug", po::value<std::string>()->default_value("0"), "Debug flags")
   ;
 }
@@ -358,6 +462,14 @@ bool Options::Progress() const {
   return p_->Progress();
 }
 
+bool Options::Lazy() const {
+  return p_->Lazy();
+}
+
+bool Options::Direct() const {
+  return p_->Direct();
+}
+
 uint32_t Options::BeginMillisec() const {
   return p_->BeginMillisec();
 }
@@ -374,6 +486,14 @@ uint32_t Options::BatchDurationMillisec() const {
   return p_->BatchDurationMillisec();
 }
 
+uint32_t Options::BatchMaxEvents() const {
+  return p_->BatchMaxEvents();
+}
+
+uint32_t Options::BatchBudgetMicrosec() const {
+  return p_->BatchBudgetMicrosec();
+}
+
 float Options::Tempo() const {
   return p_->Tempo();
 }
@@ -386,6 +506,10 @@ unsigned Options::Tuning() const {
   return p_->Tuning();
 }
 
+unsigned Options::Threads() const {
+  return p_->Threads();
+}
+
 Options::k2range_t Options::GetTracksVelocityMap() const {
   return p_->GetTracksVelocityMap();
 }
@@ -394,6 +518,38 @@ Options::k2range_t Options::GetChannelsVelocityMap() const {
   return p_->GetChannelsVelocityMap();
 }
 
+std::vector<unsigned> Options::GetMutedTracks() const {
+  return p_->GetMutedTracks();
+}
+
+std::vector<unsigned> Options::GetMutedChannels() const {
+  return p_->GetMutedChannels();
+}
+
+std::vector<unsigned> Options::GetSoloTracks() const {
+  return p_->GetSoloTracks();
+}
+
+std::vector<unsigned> Options::GetSoloChannels() const {
+  return p_->GetSoloChannels();
+}
+
+std::vector<unsigned> Options::GetFilterTracks() const {
+  return p_->GetFilterTracks();
+}
+
+std::vector<unsigned> Options::GetFilterChannels() const {
+  return p_->GetFilterChannels();
+}
+
+Options::range_t Options::GetFilterKeys() const {
+  return p_->GetFilterKeys();
+}
+
+std::vector<std::string> Options::GetFilterKinds() const {
+  return p_->GetFilterKinds();
+}
+
 uint32_t Options::Debug() const {
   return p_->Debug();
 }
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 class _OptionsImpl;
 
@@ -22,15 +23,29 @@ class Options {
   std::string DumpPath() const;
   bool Play() const;
   bool Progress() const;
+  bool Lazy() const;
+  bool Direct() const;
   uint32_t BeginMillisec() const;
   uint32_t EndMillisec() const;
   uint32_t DelayMillisec() const;
   uint32_t BatchDurationMillisec() const;
+  uint32_t BatchMaxEvents() const;
+  uint32_t BatchBudgetMicrosec() const;
   float Tempo() const;
   int8_t KeyShift() const;
   unsigned Tuning() const;
+  unsigned Threads() const;
   k2range_t GetTracksVelocityMap() const;
   k2range_t GetChannelsVelocityMap() const;
+  std::vector<unsigned> GetMutedTracks() const;
+  std::vector<unsigned> GetMutedChannels() const;
+  std::vector<unsigned> GetSoloTracks() const;
+  std::vector<unsigned> GetSoloChannels() const;
+  // Parse time filter, empty for all
+  std::vector<unsigned> GetFilterTracks() const;
+  std::vector<unsigned> GetFilterChannels() const;
+  range_t GetFilterKeys() const; // empty, [0] > [1], if invalid
+  std::vector<std::string> GetFilterKinds() const;
   uint32_t Debug() const; // flags
   std::string MidifilePath() const;
   std::string SoundfontsPath() const;
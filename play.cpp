@@ -2,162 +2,206 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <iostream>
 #include <iostream>
 #include <mutex>
 #include <numeric>
-#include <tuple>
+#include <queue>
+#include <span>
+#include <thread>
 #include <vector>
 #include <cmath>
 #include <fmt/core.h>
 #include <fluidsynth.h>
+#include "generator.h"
+#include "intervaltree.h"
+#include "notetransform.h"
+#include "spscring.h"
 #include "synthseq.h"
 #include "util.h"
 
+// Packed, 12 bytes
 class IndexEvent {
  public:
-  IndexEvent(uint32_t time=0, size_t track=0, size_t tei=0) :
-    time_{time}, track_{track}, tei_{tei} {}
+  IndexEvent(uint32_t time=0, uint16_t track=0, uint32_t tei=0) :
+    time_{time}, tei_{tei}, track_{track} {}
   uint32_t time_{0}; // sum of delta_time
-  size_t track_{0};
-  size_t tei_{0}; // track event index;
+  uint32_t tei_{0}; // track event index;
+  uint16_t track_{0};
 };
-bool operator<(const IndexEvent& ie0, const IndexEvent& ie1) {
-  return
-    std::tie(ie0.time_, ie0.track_, ie0.tei_) <
-    std::tie(ie1.time_, ie1.track_, ie1.tei_);
-}
 
 class Player; // forward
 
+// Flat record of an event to be sent, tagged by kind_.
+// Sysex messages are kept by the Player, value_ indexes them.
 class AbsEvent {
  public:
-  AbsEvent(uint32_t time_ms=0, uint32_t time_ms_original=0) :
-    time_ms_{time_ms}, time_ms_original_{time_ms_original} {}
-  virtual ~AbsEvent() {}
-  virtual void SetSendFluidEvent(
-    fluid_event_t *event, const Player *player, uint32_t date_ms) = 0;
-  virtual uint32_t end_time_ms() const { return time_ms_; }
-  virtual std::string str() const = 0;
-  uint32_t time_ms_;
-  uint32_t time_ms_original_;
-};
-
-class NoteEvent : public AbsEvent {
- public:
-  NoteEvent(
+  enum Kind : uint8_t { Note, ProgramChange, PitchWheel, SysEx, Final };
+  AbsEvent(
+    Kind kind=Final,
     uint32_t time_ms=0,
     uint32_t time_ms_original=0,
-    int channel=0,
-    int16_t key=0,
-    int16_t velocity=0,
-    uint32_t duration_ms=0,
-    uint32_t duration_ms_original=0) :
-      AbsEvent(time_ms, time_ms_original),
+    uint8_t channel=0,
+    uint32_t value=0,
+    uint8_t key=0,
+    uint8_t velocity=0,
+    uint32_t duration_ms=0) :
+      time_ms_{time_ms},
+      time_ms_original_{time_ms_original},
+      duration_ms_{duration_ms},
+      value_{value},
+      kind_{kind},
       channel_{channel},
       key_{key},
-      velocity_{velocity},
-      duration_ms_{duration_ms},
-      duration_ms_original_{duration_ms_original} {}
-  virtual ~NoteEvent() {}
-  void SetSendFluidEvent(
-    fluid_event_t *event, const Player *player, uint32_t date_ms);
+      velocity_{velocity} {
+  }
   uint32_t end_time_ms() const { return time_ms_ + duration_ms_; }
-  std::string str() const {
-    return fmt::format(
+  std::string str() const;
+  uint32_t time_ms_;
+  uint32_t time_ms_original_;
+  uint32_t duration_ms_; // of Note
+  uint32_t value_; // program, bend or sysex index
+  Kind kind_;
+  uint8_t channel_;
+  uint8_t key_;
+  uint8_t velocity_;
+};
+
+std::string AbsEvent::str() const {
+  std::string s;
+  switch (kind_) {
+   case Note:
+    s = fmt::format(
       "Note(t={}, channel={}, key={}, velocity={}, duration={})",
       time_ms_, channel_, key_, velocity_, duration_ms_);
+    break;
+   case ProgramChange:
+    s = fmt::format("ProgramChange(t={}, channel={}, program={})",
+      time_ms_, channel_, value_);
+    break;
+   case PitchWheel:
+    s = fmt::format("PitchWheel(t={}, channel={}, bend={})",
+      time_ms_, channel_, value_);
+    break;
+   case SysEx:
+    s = fmt::format("SysEx(t={}, index={})", time_ms_, value_);
+    break;
+   case Final:
+    s = fmt::format("Final(t={})", time_ms_);
+    break;
   }
-  int channel_;
-  int16_t key_;
-  int16_t velocity_;
-  uint32_t duration_ms_;
-  uint32_t duration_ms_original_;
-};
+  return s;
+}
 
-class ProgramChange : public AbsEvent {
+// Event of the direct rendering, dated by its sample since playing started.
+// Notes are split to on and off events.
+class DirectEvent {
  public:
-  ProgramChange(
-    uint32_t time_ms=0,
-    uint32_t time_ms_original=0,
-    int channel=0,
-    int program=0) :
-      AbsEvent{time_ms, time_ms_original},
+  enum Kind : uint8_t {
+    NoteOff, NoteOn, ProgramChange, PitchWheel, SysEx, Final };
+  DirectEvent(
+    Kind kind=Final,
+    uint64_t sample=0,
+    uint8_t channel=0,
+    uint32_t value=0,
+    uint8_t key=0,
+    uint8_t velocity=0) :
+      sample_{sample},
+      value_{value},
+      kind_{kind},
       channel_{channel},
-      program_{program} {
-  }
-  virtual ~ProgramChange() {}
-  void SetSendFluidEvent(
-    fluid_event_t *event, const Player *player, uint32_t date_ms);
-  std::string str() const {
-    return fmt::format("ProgramChange(t={}, channel={}, program={})",
-      time_ms_, channel_, program_);
+      key_{key},
+      velocity_{velocity} {
   }
-  int channel_;
-  int program_;
+  uint64_t sample_;
+  uint32_t value_; // program, bend, sysex index or NoteOn samples
+  Kind kind_;
+  uint8_t channel_;
+  uint8_t key_;
+  uint8_t velocity_;
 };
 
-class PitchWheel : public AbsEvent {
+// For a min heap of direct events
+class LaterSample {
  public:
-  PitchWheel(
-    uint32_t time_ms=0,
-    uint32_t time_ms_original=0,
-    int channel=0,
-    int bend=0) :
-      AbsEvent{time_ms, time_ms_original},
-      channel_{channel},
-      bend_{bend} {
-  }
-  virtual ~PitchWheel() {}
-  void SetSendFluidEvent(
-    fluid_event_t *event, const Player *player, uint32_t date_ms);
-  std::string str() const {
-    return fmt::format("PitchWheel(t={}, channel={}, bend={})",
-      time_ms_, channel_, bend_);
+  bool operator()(const DirectEvent &e0, const DirectEvent &e1) const {
+    return e0.sample_ > e1.sample_;
   }
-  int channel_;
-  int bend_;
-};
-
-class FinalEvent : public AbsEvent {
- public:
-  FinalEvent(uint32_t time_ms=0, uint32_t time_ms_original=0) :
-    AbsEvent{time_ms, time_ms_original} {}
-  virtual ~FinalEvent() {}
-  void SetSendFluidEvent(
-    fluid_event_t *event, const Player *player, uint32_t date_ms);
-  std::string str() const { return fmt::format("Final(t={})", time_ms_); }
 };
 
-class DynamicTiming {
+// Piecewise linear ticks to milliseconds mapping, one segment per tempo.
+// Ticks are shifted to the first note. Rounding follows the sequential
+// per event computation, so dates are unchanged. Spans are timed by the
+// tempos within, not by the tempo at their start.
+class TempoMap {
  public:
-  DynamicTiming(
-    uint64_t microseconds_per_quarter=0,
-    uint64_t k_ticks_per_quarter=0,
-    uint32_t ticks_ref=0,
-    uint32_t ms_ref=0) : 
-      microseconds_per_quarter_{microseconds_per_quarter},
-      k_ticks_per_quarter_{k_ticks_per_quarter},
-      ticks_ref_{ticks_ref},
-      ms_ref_{ms_ref} {
-  }
-  void SetMicrosecondsPerQuarter(uint32_t curr_ticks, uint64_t ms_per_quarter) {
-    ms_ref_ = AbsTicksToMs(curr_ticks);
-    ticks_ref_ = curr_ticks;
-    microseconds_per_quarter_ = ms_per_quarter;
-  }
-  uint32_t TicksToMs(uint32_t ticks) const {
-    uint64_t number = uint64_t{ticks} * microseconds_per_quarter_;
-    uint32_t ms = RoundDiv(number, k_ticks_per_quarter_);
-    return ms;
-  }
-  uint32_t AbsTicksToMs(uint32_t abs_ticks) {
-    uint64_t numer = uint64_t{abs_ticks - ticks_ref_} *
-      microseconds_per_quarter_;
-    uint32_t add = RoundDiv(numer, k_ticks_per_quarter_);
-    uint32_t ms = ms_ref_ + add;
-    return ms;
+  class Segment {
+   public:
+    Segment(
+      uint32_t ticks=0,
+      uint32_t ms=0,
+      uint32_t microseconds_per_quarter=500000,
+      size_t from_iei=0) :
+        ticks_{ticks},
+        ms_{ms},
+        microseconds_per_quarter_{microseconds_per_quarter},
+        from_iei_{from_iei} {
+    }
+    uint32_t ticks_;
+    uint32_t ms_;
+    uint32_t microseconds_per_quarter_;
+    size_t from_iei_; // first index event timed by this segment
+  };
+  TempoMap(uint64_t k_ticks_per_quarter=1) :
+    k_ticks_per_quarter_{k_ticks_per_quarter}, segments_{Segment{}} {}
+  // Tempo event at index iei. Must be added in index order.
+  void AddTempo(uint32_t ticks, uint32_t microseconds_per_quarter, size_t iei) {
+    segments_.push_back(Segment{
+      ticks, TicksToMs(segments_.back(), ticks), microseconds_per_quarter,
+      iei + 1});
+  }
+  const std::vector<Segment> &GetSegments() const { return segments_; }
+  uint32_t TicksToMs(const Segment &segment, uint32_t ticks) const {
+    return segment.ms_ + DurationToMs(segment, ticks - segment.ticks_);
+  }
+  uint32_t DurationToMs(const Segment &segment, uint32_t ticks) const {
+    uint64_t number = uint64_t{ticks} * segment.microseconds_per_quarter_;
+    return RoundDiv(number, k_ticks_per_quarter_);
+  }
+  // Milliseconds from ticks, timed by segment, to ticks + duration
+  uint32_t SpanToMs(const Segment &segment, uint32_t ticks, uint32_t duration)
+      const {
+    const uint32_t end = ticks + duration;
+    auto iter = std::upper_bound(
+      segments_.begin() + (&segment - segments_.data()) + 1, segments_.end(),
+      end, [](uint32_t t, const Segment &s) { return t < s.ticks_; });
+    return TicksToMs(*(iter - 1), end) - TicksToMs(segment, ticks);
+  }
+  // Segment timing index event iei
+  const Segment &SegmentAt(size_t iei) const {
+    auto iter = std::upper_bound(segments_.begin(), segments_.end(), iei,
+      [](size_t i, const Segment &segment) { return i < segment.from_iei_; });
+    return *(iter - 1);
+  }
+  // Smallest ticks with TicksToMs(ticks) >= ms, beyond 32 bits if none.
+  uint64_t MsToTicks(uint64_t ms) const {
+    auto iter = std::lower_bound(segments_.begin(), segments_.end(), ms,
+      [](const Segment &segment, uint64_t m) { return segment.ms_ < m; });
+    uint64_t ticks = 0;
+    if (iter != segments_.begin()) {
+      // RoundDiv(dt * us, k) >= d  <=>  dt * us >= d * k - k/2
+      const Segment &segment = *(iter - 1);
+      const uint64_t us = segment.microseconds_per_quarter_;
+      const uint64_t k = k_ticks_per_quarter_;
+      const uint64_t need = (ms - segment.ms_) * k - k/2;
+      ticks = segment.ticks_ + (us != 0 ? (need + us - 1) / us : 1ull << 32);
+      if (iter != segments_.end()) {
+        ticks = std::min<uint64_t>(ticks, iter->ticks_);
+      }
+    }
+    return ticks;
   }
  private:
   static uint32_t RoundDiv(uint64_t n, uint64_t d) {
@@ -169,77 +213,129 @@ class DynamicTiming {
     uint32_t ret = static_cast<uint32_t>(q);
     return ret;
   }
-  uint64_t microseconds_per_quarter_{0};
-  uint64_t k_ticks_per_quarter_{0};
-  uint32_t ticks_ref_{0};
-  uint32_t ms_ref_{0};
+  uint64_t k_ticks_per_quarter_;
+  std::vector<Segment> segments_;
 };
 
 ////////////////////////////////////////////////////////////////////////
 
 class CallBackData {
  public:
-  enum CallBack { Periodic, Final, Progress };
+  enum CallBack { Periodic, Final, Progress, SysEx };
   CallBackData(CallBack ecb, Player *player) : ecb_{ecb}, player_{player} {}
   CallBack ecb_;
   Player *player_;
 };
 
 ////////////////////////////////////////////////////////////////////////
-class Affine {
+
+// Sizes and durations of the periodic callback batches
+class BatchStats {
  public:
-  using range_t = std::array<uint8_t, 2>;
-  Affine(const range_t& source, const range_t &target) :
-    s0_{source[0]},
-    t0_{target[0]},
-    ds_{uint32_t{source[1]} - s0_},
-    dt_{uint32_t{target[1]} - t0_} {
+  void Add(size_t n_events, uint64_t us, bool capped) {
+    ++n_batches_;
+    n_capped_ += capped ? 1 : 0;
+    n_events_ += n_events;
+    max_events_ = std::max(max_events_, n_events);
+    us_ += us;
+    max_us_ = std::max(max_us_, us);
   }
-  uint8_t Map(uint8_t s) const {
-    uint32_t t = t0_ + (ds_ != 0 ? ((uint32_t(s) - s0_)*dt_)/ds_ : dt_/2);
-    return static_cast<uint8_t>(t);
+  std::string str() const {
+    return fmt::format("batches={} capped={} events: total={} max={}, "
+      "callback: total={}us max={}us",
+      n_batches_, n_capped_, n_events_, max_events_, us_, max_us_);
   }
- private:
-  uint32_t s0_;
-  uint32_t t0_;
-  uint32_t ds_;
-  uint32_t dt_;
+  size_t n_batches_{0};
+  size_t n_capped_{0};
+  size_t n_events_{0};
+  size_t max_events_{0};
+  uint64_t us_{0};
+  uint64_t max_us_{0};
 };
- 
+
 ////////////////////////////////////////////////////////////////////////
 
 class Player {
  public:
   enum SeqId : size_t { 
-    SeqIdSynth, SeqIdPeriodic, SeqIdFinal, SeqIdProgress, SeqId_N };
+    SeqIdSynth, SeqIdPeriodic, SeqIdFinal, SeqIdProgress, SeqIdSysEx,
+    SeqId_N };
   Player(const midi::Midi &pm, SynthSequencer &ss, const PlayParams &pp) :
-    pm_{pm}, ss_{ss}, pp_{pp} {
+    pm_{pm}, ss_{ss}, pp_{pp}, ring_{pp.direct_ ? 1 : ring_capacity} {
     std::fill(seq_ids_.begin(), seq_ids_.end(), -1);
     seq_ids_[SeqIdSynth] = ss.synth_seq_id_;
+    send_event_ = new_fluid_event();
+    for (fluid_event_t *&e: timer_events_) {
+      e = new_fluid_event();
+      fluid_event_set_source(e, -1);
+      fluid_event_timer(e, nullptr);
+    }
+  }
+  ~Player() {
+    delete_fluid_event(send_event_);
+    for (fluid_event_t *e: timer_events_) {
+      delete_fluid_event(e);
+    }
   }
   const SynthSequencer &GetSynthSequencer() const { return ss_; }
   int GetSeqId(SeqId esi) const { return seq_ids_[esi]; }
   int run();
 
  private:
-  using range_t = std::array<uint8_t, 2>;
-  using key2affine_t = std::unordered_map<uint8_t, Affine>;
+  using abs_events_t = std::vector<AbsEvent>;
+  using sysex_data_t = std::vector<std::span<const uint8_t>>;
   void SetIndexEvents();
+  void SetNoteDurations();
   uint32_t GetFirstNoteTime();
+  void SetTempoMap();
+  uint32_t ShiftedTicks(size_t iei) const {
+    const uint32_t t = index_events_[iei].time_;
+    return t < first_note_time_ ? 0 : t - first_note_time_;
+  }
+  size_t FirstIndexAtTicks(uint64_t shifted_ticks) const;
+  void ChaseBegin(size_t i_begin);
+  void SetNotesIndex();
+  void ChaseSoundingNotes(size_t i_begin, uint32_t ticks_begin);
   void SetAbsEvents();
+  void GenerateAbsEvents(uint64_t until_ms);
+  void GenerateAbsEventsParallel();
+  void HandleIndexEvent(
+    size_t index_event_index,
+    const TempoMap::Segment &segment,
+    abs_events_t &abs_events,
+    sysex_data_t &sysex_data) const;
+  void DumpAbsEvents(size_t from) const;
+  void Produce();
   bool RetuneNeeded() const { return (pp_.tuning_ != 440); }
   void Retune();
   void play();
-  void SetVelocitiesMap();
-  void HandleMeta(const midi::MetaEvent*, DynamicTiming&, uint32_t ts);
+  void SetDirectEvents();
+  const DirectEvent *NextDirectEvent() const;
+  void PlayDirect();
   void HandleMidi(
-    const midi::MidiEvent*,
-    DynamicTiming& dyn_timing,
+    const midi::Event&,
+    const TempoMap::Segment &segment,
     size_t index_event_index,
-    uint32_t date_ms);
-  uint32_t GetNoteDuration(size_t iei, const midi::NoteOnEvent &note_on) const;
-  uint8_t MapVelocity(const midi::NoteOnEvent *note_on, uint8_t itrack) const;
+    uint32_t date_ms,
+    abs_events_t &abs_events) const;
+  void HandleSysEx(
+    const midi::Track &track,
+    const midi::Event &sysex,
+    uint32_t date_ms,
+    abs_events_t &abs_events,
+    sysex_data_t &sysex_data) const;
+  void AddNote(
+    const midi::Event &note_on,
+    size_t index_event_index,
+    uint32_t date_ms_modified,
+    uint32_t date_ms,
+    uint32_t duration_ms,
+    abs_events_t &abs_events) const;
   static uint32_t FactorU32(double f, uint32_t u);
+  static uint64_t MicrosecondsSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - t0).count();
+  }
   static void MaxBy(uint32_t &v, uint32_t x) { if (v < x) { v = x; } }
 
   static void callback(
@@ -259,30 +355,92 @@ class Player {
     unsigned int time,
     fluid_event_t *event,
     fluid_sequencer_t *seq);
+  void sysex_callback(
+    unsigned int time,
+    fluid_event_t *event,
+    fluid_sequencer_t *seq);
+  Generator<uint32_t> SendBatches();
   void SchedulePeriodicAt(uint32_t at) {
-    ScheduleCallback(seq_ids_[SeqIdPeriodic], at);
+    ScheduleCallback(SeqIdPeriodic, at);
   }
   void ScheduleProgressAt(uint32_t at) {
-    ScheduleCallback(seq_ids_[SeqIdProgress], at);
+    ScheduleCallback(SeqIdProgress, at);
   }
-  void ScheduleCallback(int seq_id, uint32_t at);
+  void ScheduleCallback(SeqId esi, uint32_t at);
+  static int render_callback(
+    void *data,
+    int len,
+    int nfx,
+    float *fx[],
+    int nout,
+    float *out[]);
+  int Render(int len, int nfx, float *fx[], int nout, float *out[]);
+  void ApplyDirectEvent(const DirectEvent &e);
+  void SendSysEx(size_t index) const;
+  void ShowProgress(uint32_t time) const;
+  void SendFluidEvent(
+    fluid_event_t *event,
+    const AbsEvent &e,
+    uint32_t date_ms);
 
   int rc_{0};
 
   const midi::Midi &pm_; // parsed_midi
   SynthSequencer &ss_;
   const PlayParams &pp_;
-  key2affine_t tracks_velocity_map_;
-  key2affine_t channels_velocity_map_;
+  NoteTransform note_transform_;
 
   std::vector<IndexEvent> index_events_;
-  std::vector<std::unique_ptr<AbsEvent>> abs_events_;
+  std::vector<uint32_t> note_durations_; // ticks, of NoteOn index events
+  uint32_t first_note_time_{0};
+  TempoMap tempo_map_;
+  IntervalTree notes_index_; // of shifted ticks, ids index notes_iei_
+  std::vector<uint32_t> notes_iei_;
+  abs_events_t abs_events_; // from abs_base_, if lazy or direct
+  size_t abs_base_{0}; // number of dropped pushed abs events
+  bool abs_events_complete_{false}; // final event added
+  uint32_t last_ms_original_{0};
+  // Generation state, index events [next_iei_, end_iei_) are pending
+  size_t next_iei_{0};
+  size_t end_iei_{0};
+  size_t iseg_{0}; // tempo segment of next_iei_
+  // Complete sysex messages, without the F0 and F7 framing.
+  // If lazy, reserved for all, so it grows while playing without moving.
+  sysex_data_t sysex_data_;
+
+  // The producer thread pushes abs events to the ring,
+  // periodic_callback pops and sends them, without locks.
+  // Not used if direct.
+  static constexpr size_t ring_capacity = 0x10000;
+  SpscRing<AbsEvent> ring_;
+  std::atomic<bool> ring_filled_{false}; // first time, or all pushed
+  std::atomic<bool> producer_stop_{false};
 
   std::array<int, SeqId_N>  seq_ids_;
-  size_t next_send_index_{0};
-  uint32_t date_add_ms_{0};
+  // Reused, the sequencer copies sent events.
+  // send_event_ is used by SendBatches, a timer event by its client.
+  fluid_event_t *send_event_{nullptr};
+  std::array<fluid_event_t*, SeqId_N> timer_events_;
+  // Resumed by periodic_callback, that keeps no other sending state
+  Generator<uint32_t> batches_;
+  BatchStats batch_stats_; // or of render blocks, if direct
+
+  // Direct rendering, events are applied by the audio driver thread
+  std::vector<DirectEvent> direct_events_; // by sample, no note offs
+  // Of the applied NoteOn events, reserved for the most sounding notes
+  std::priority_queue<DirectEvent, std::vector<DirectEvent>, LaterSample>
+    note_offs_;
+  size_t next_direct_{0};
+  uint32_t sample_rate_{44100};
+  std::atomic<uint64_t> rendered_samples_{0};
+  size_t n_sub_blocks_{0};
+  uint32_t internal_bufsize_{64}; // of the synth, its rendering unit
+  uint64_t sum_error_samples_{0}; // of applied events, from their samples
+  uint64_t max_error_samples_{0};
+
+  static constexpr uint32_t undated = std::numeric_limits<uint32_t>::max();
+  uint32_t date_add_ms_{undated}; // set when the first event is sent
   std::atomic<bool> final_handled_{false};
-  std::mutex sending_mtx_;
   std::mutex play_mtx_;
   std::condition_variable cv_;
 };
@@ -290,12 +448,17 @@ class Player {
 int Player::run() {
   if (pp_.debug_ & 0x1) { std::cerr << "Player::run() begin\n"; }
   SetIndexEvents();
+  SetNoteDurations();
   if (pp_.debug_ & 0x1) { std::cerr << "Player::run() end\n"; }
   SetAbsEvents();
   if (RetuneNeeded()) {
     Retune();
   }
-  play();
+  if (pp_.direct_) {
+    PlayDirect();
+  } else {
+    play();
+  }
   return rc_;
 }
 
@@ -306,72 +469,379 @@ void Player::SetIndexEvents() {
       return r + track.events_.size();
     });
   if (pp_.debug_ & 0x1) { std::cerr << fmt::format("Total events: {}\n", ne); }
-  index_events_.reserve(ne);
-  if (pp_.debug_ & 0x100) { std::cout << "Raw events:\n"; }
-  for (size_t ti = 0; ti < tracks.size(); ++ti) {
-    if (pp_.debug_ & 0x100) {
+  if (pp_.debug_ & 0x100) {
+    std::cout << "Raw events:\n";
+    for (size_t ti = 0; ti < tracks.size(); ++ti) {
       std::cout << fmt::format("Track[{}]", ti) << " {\n";
+      const midi::Track &track = tracks[ti];
+      for (size_t tei = 0; tei < track.events_.size(); ++tei) {
+        std::cout << fmt::format("  [{:4d}] {}\n",
+          tei, track.EventDtStr(track.events_[tei]));
+      }
+      std::cout << "}\n";
+    }
+  }
+  // Each track is ordered by time, so a k-way merge of the tracks
+  // gives the (time, track, tei) order.
+  using head_t = std::pair<uint32_t, uint16_t>; // (time, track)
+  std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t>> heads;
+  std::vector<uint32_t> next_tei(tracks.size(), 0);
+  for (size_t ti = 0; ti < tracks.size(); ++ti) {
+    if (!tracks[ti].ticks_.empty()) {
+      heads.push({tracks[ti].ticks_[0], ti});
+    }
+  }
+  index_events_.reserve(ne);
+  while (!heads.empty()) {
+    const auto [time, ti] = heads.top();
+    heads.pop();
+    const std::vector<uint32_t> &ticks = tracks[ti].ticks_;
+    uint32_t &tei = next_tei[ti];
+    index_events_.push_back(IndexEvent(time, ti, tei));
+    if (++tei < ticks.size()) {
+      heads.push({ticks[tei], ti});
     }
-    const midi::Track &track = tracks[ti];
-    const std::vector<std::unique_ptr<midi::Event>> &events = track.events_;
-    const size_t nte = events.size();
-    uint32_t time = 0;
-    for (size_t tei = 0; tei < nte; ++tei) {
-      if (pp_.debug_ & 0x100) {
-        std::cout << fmt::format("  [{:4d}] {}\n", tei, events[tei]->dt_str());
+  }
+}
+
+// A NoteOff, or a zero velocity NoteOn, ends all sounding notes
+// of its channel and key. Notes never ended last until the final event.
+void Player::SetNoteDurations() {
+  const std::vector<midi::Track> &tracks = pm_.GetTracks();
+  const size_t nie = index_events_.size();
+  note_durations_.assign(nie, 0);
+  std::vector<std::vector<uint32_t>> sounding(0x10 * 0x100);
+  for (size_t i = 0; i < nie; ++i) {
+    const IndexEvent &ie = index_events_[i];
+    const midi::Event &e = tracks[ie.track_].events_[ie.tei_];
+    const bool note_on = e.kind_ == midi::EventKind::NoteOn;
+    if (note_on || (e.kind_ == midi::EventKind::NoteOff)) {
+      std::vector<uint32_t> &key_sounding =
+        sounding[0x100 * e.channel_ + e.Key()];
+      if (note_on && (e.Velocity() != 0)) {
+        key_sounding.push_back(i);
+      } else {
+        for (uint32_t j: key_sounding) {
+          note_durations_[j] = ie.time_ - index_events_[j].time_;
+        }
+        key_sounding.clear();
       }
-      uint32_t dt = events[tei]->delta_time_;
-      time += dt;
-      index_events_.push_back(IndexEvent(time, ti, tei));
     }
-    if (pp_.debug_ & 0x100) { std::cout << "}\n"; }
   }
-  std::sort(index_events_.begin(), index_events_.end());
+  const uint32_t last_time = nie > 0 ? index_events_.back().time_ : 0;
+  for (const std::vector<uint32_t> &key_sounding: sounding) {
+    for (uint32_t j: key_sounding) {
+      note_durations_[j] = last_time - index_events_[j].time_;
+    }
+  }
 }
 
-void Player::SetAbsEvents() {
+void Player::SetTempoMap() {
   const std::vector<midi::Track> &tracks = pm_.GetTracks();
-  DynamicTiming dyn_timing{
-    500000,
-    1000ull * uint64_t{pm_.GetTicksPerQuarterNote()},
-    0, 0};
-  uint32_t first_note_time = GetFirstNoteTime();
-  SetVelocitiesMap();
-  bool done = false;
-  size_t ie_size = index_events_.size();
-  auto safe_subtract = [](uint32_t l, uint32_t r) { return l < r ? 0 : l - r; };
-  for (size_t i = 0; (i < ie_size) && !done; ++i) {
+  tempo_map_ = TempoMap(1000ull * uint64_t{pm_.GetTicksPerQuarterNote()});
+  for (size_t i = 0; i < index_events_.size(); ++i) {
+    const IndexEvent &ie = index_events_[i];
+    const midi::Event &e = tracks[ie.track_].events_[ie.tei_];
+    if (e.kind_ == midi::EventKind::Tempo) {
+      tempo_map_.AddTempo(ShiftedTicks(i), e.Tempo(), i);
+    }
+  }
+  if (pp_.debug_ & 0x1) {
+    std::cerr << fmt::format("Tempo segments: {}\n",
+      tempo_map_.GetSegments().size());
+  }
+}
+
+size_t Player::FirstIndexAtTicks(uint64_t shifted_ticks) const {
+  size_t i = 0;
+  if (shifted_ticks > 0) {
+    const uint64_t ticks = shifted_ticks + first_note_time_;
+    auto iter = std::lower_bound(index_events_.begin(), index_events_.end(),
+      ticks,
+      [](const IndexEvent &ie, uint64_t t) { return ie.time_ < t; });
+    i = iter - index_events_.begin();
+  }
+  return i;
+}
+
+// Events before begin are not played, but the channels state they leave
+// is sent at start: All complete sysex messages (typically GM/GS resets),
+// then the last program and pitch bend of each channel.
+// Controllers are not played, so there is no controllers state to chase.
+void Player::ChaseBegin(size_t i_begin) {
+  static constexpr size_t none = std::numeric_limits<size_t>::max();
+  const std::vector<midi::Track> &tracks = pm_.GetTracks();
+  std::array<size_t, 0x10> program_iei, bend_iei;
+  program_iei.fill(none);
+  bend_iei.fill(none);
+  for (size_t i = 0; i < i_begin; ++i) {
     const IndexEvent &ie = index_events_[i];
-    uint32_t time_shifted = safe_subtract(ie.time_, first_note_time);
-    uint32_t date_ms = dyn_timing.AbsTicksToMs(time_shifted);
-    done = date_ms > pp_.end_ms_;
-    if (!done) {
-      const midi::Event *e = tracks[ie.track_].events_[ie.tei_].get();
-      if (pp_.debug_ & 0x80) {
-        std::cout << fmt::format("[{:4}] time={} shifted={}, track_event={}\n",
-          i, ie.time_, time_shifted, e->str());
+    const midi::Track &track = tracks[ie.track_];
+    const midi::Event &e = track.events_[ie.tei_];
+    switch (e.kind_) {
+     case midi::EventKind::ProgramChange:
+      program_iei[e.channel_] = i;
+      break;
+     case midi::EventKind::PitchWheel:
+      bend_iei[e.channel_] = i;
+      break;
+     case midi::EventKind::SysEx:
+      HandleSysEx(track, e, tempo_map_.TicksToMs(
+        tempo_map_.SegmentAt(i), ShiftedTicks(i)), abs_events_, sysex_data_);
+      break;
+     default:
+      break;
+    }
+  }
+  size_t n_chased = 0;
+  for (const std::array<size_t, 0x10> &chased: {program_iei, bend_iei}) {
+    for (size_t i: chased) {
+      if (i != none) {
+        const IndexEvent &ie = index_events_[i];
+        const TempoMap::Segment &segment = tempo_map_.SegmentAt(i);
+        HandleMidi(tracks[ie.track_].events_[ie.tei_], segment, i,
+          tempo_map_.TicksToMs(segment, ShiftedTicks(i)), abs_events_);
+        ++n_chased;
+      }
+    }
+  }
+  if (pp_.debug_ & 0x1) {
+    std::cerr << fmt::format("Chased {} of {} events before begin\n",
+      n_chased, i_begin);
+  }
+}
+
+void Player::SetNotesIndex() {
+  std::vector<IntervalTree::interval_t> intervals;
+  notes_iei_.clear();
+  for (size_t i = 0; i < note_durations_.size(); ++i) {
+    if (note_durations_[i] > 0) {
+      const uint32_t start = ShiftedTicks(i);
+      notes_iei_.push_back(i);
+      intervals.push_back({start, start + note_durations_[i]});
+    }
+  }
+  notes_index_.Build(intervals);
+}
+
+// Notes started before begin, and still sounding at begin,
+// are started at begin with their remaining duration.
+void Player::ChaseSoundingNotes(size_t i_begin, uint32_t ticks_begin) {
+  if (notes_index_.empty()) {
+    SetNotesIndex();
+  }
+  const std::vector<midi::Track> &tracks = pm_.GetTracks();
+  std::vector<uint32_t> ids = notes_index_.Stab(ticks_begin);
+  std::sort(ids.begin(), ids.end()); // by start
+  size_t n_sounding = 0;
+  for (uint32_t id: ids) {
+    const size_t i = notes_iei_[id];
+    if (i < i_begin) {
+      const IndexEvent &ie = index_events_[i];
+      const TempoMap::Segment &segment = tempo_map_.SegmentAt(i);
+      const uint32_t date_ms = tempo_map_.TicksToMs(segment, ShiftedTicks(i));
+      const uint32_t end_ms = date_ms + tempo_map_.SpanToMs(
+        segment, ShiftedTicks(i), note_durations_[i]);
+      if (end_ms > pp_.begin_ms_) {
+        AddNote(tracks[ie.track_].events_[ie.tei_], i, 0, pp_.begin_ms_,
+          end_ms - pp_.begin_ms_, abs_events_);
+        ++n_sounding;
+      }
+    }
+  }
+  if (pp_.debug_ & 0x1) {
+    std::cerr << fmt::format("{} notes sounding at begin\n", n_sounding);
+  }
+}
+
+void Player::SetAbsEvents() {
+  first_note_time_ = GetFirstNoteTime();
+  SetTempoMap();
+  note_transform_.Build(pm_, pp_);
+  const size_t i_begin = FirstIndexAtTicks(
+    tempo_map_.MsToTicks(pp_.begin_ms_));
+  const size_t i_end = std::max(i_begin, FirstIndexAtTicks(
+    tempo_map_.MsToTicks(uint64_t{pp_.end_ms_} + 1)));
+  if (pp_.debug_ & 0x1) {
+    std::cerr << fmt::format("index events: begin={} end={} of {}\n",
+      i_begin, i_end, index_events_.size());
+  }
+  ChaseBegin(i_begin);
+  if (i_begin > 0) {
+    const uint64_t ticks_begin = tempo_map_.MsToTicks(pp_.begin_ms_);
+    ChaseSoundingNotes(i_begin, std::min<uint64_t>(
+      ticks_begin, std::numeric_limits<uint32_t>::max()));
+  }
+  next_iei_ = i_begin;
+  end_iei_ = i_end;
+  iseg_ = &tempo_map_.SegmentAt(i_begin) - tempo_map_.GetSegments().data();
+  if (pp_.lazy_ || pp_.direct_) {
+    const std::vector<midi::Track> &tracks = pm_.GetTracks();
+    sysex_data_.reserve(sysex_data_.size() + std::count_if(
+      index_events_.begin() + i_begin, index_events_.begin() + i_end,
+      [&tracks](const IndexEvent &ie) {
+        return tracks[ie.track_].events_[ie.tei_].IsSysEx();
+      }));
+    // Estimated by the last index event, for progress
+    last_ms_original_ = i_begin < i_end
+      ? tempo_map_.TicksToMs(tempo_map_.SegmentAt(i_end - 1),
+          ShiftedTicks(i_end - 1)) + 1
+      : (abs_events_.empty() ? 0 : abs_events_.back().time_ms_original_ + 1);
+  } else {
+    GenerateAbsEventsParallel();
+    GenerateAbsEvents(uint64_t{1} << 32);
+    last_ms_original_ = abs_events_.back().time_ms_original_;
+    if (pp_.debug_ & 0x4) {
+      const size_t nae = abs_events_.size();
+      std::cout << fmt::format("abs_events[{}]", nae) << "{\n";
+      DumpAbsEvents(0);
+      std::cout << fmt::format("abs_events[{}]", nae) << "{\n";
+    }
+  }
+}
+
+// Index events are turned into abs events, until one dated
+// at or after until_ms is added. The final event follows the last one.
+void Player::GenerateAbsEvents(uint64_t until_ms) {
+  const std::vector<TempoMap::Segment> &segments = tempo_map_.GetSegments();
+  const size_t nae = abs_events_.size();
+  bool reached = false;
+  for (; (next_iei_ < end_iei_) && !reached; ++next_iei_) {
+    while ((iseg_ + 1 < segments.size()) &&
+        (segments[iseg_ + 1].from_iei_ <= next_iei_)) {
+      ++iseg_;
+    }
+    HandleIndexEvent(next_iei_, segments[iseg_], abs_events_, sysex_data_);
+    reached = (abs_events_.size() > nae) &&
+      (abs_events_.back().time_ms_ >= until_ms);
+  }
+  if ((next_iei_ == end_iei_) && !abs_events_complete_) {
+    abs_events_.push_back(AbsEvent(AbsEvent::Final,
+      abs_events_.empty() ? 0 : abs_events_.back().end_time_ms() + 1,
+      abs_events_.empty() ? 0 : abs_events_.back().time_ms_original_ + 1));
+    abs_events_complete_ = true;
+  }
+  if (pp_.lazy_ && (pp_.debug_ & 0x4)) {
+    DumpAbsEvents(nae);
+  }
+}
+
+// Pending index events are split to contiguous chunks, one per thread.
+// The events of a chunk depend only on the tempo map, so chunks are
+// generated independently and concatenated in order.
+void Player::GenerateAbsEventsParallel() {
+  static constexpr size_t min_chunk_size = 0x4000;
+  const size_t n = end_iei_ - next_iei_;
+  const size_t nchunks = (pp_.debug_ & 0x80) // keep trace in order
+    ? 1 : std::min<size_t>(pp_.threads_, n / min_chunk_size);
+  if (pp_.debug_ & 0x1) {
+    std::cerr << fmt::format("GenerateAbsEvents: {} events, {} chunks\n",
+      n, nchunks);
+  }
+  if (nchunks > 1) {
+    const std::vector<TempoMap::Segment> &segments =
+      tempo_map_.GetSegments();
+    std::vector<abs_events_t> chunks_events(nchunks);
+    std::vector<sysex_data_t> chunks_sysex(nchunks);
+    auto generate = [&](size_t c) {
+      const size_t i0 = next_iei_ + (n * c) / nchunks;
+      const size_t i1 = next_iei_ + (n * (c + 1)) / nchunks;
+      size_t iseg = &tempo_map_.SegmentAt(i0) - segments.data();
+      for (size_t i = i0; i < i1; ++i) {
+        while ((iseg + 1 < segments.size()) &&
+            (segments[iseg + 1].from_iei_ <= i)) {
+          ++iseg;
+        }
+        HandleIndexEvent(i, segments[iseg], chunks_events[c], chunks_sysex[c]);
       }
-      const midi::MetaEvent *meta_event =
-        dynamic_cast<const midi::MetaEvent*>(e);
-      const midi::MidiEvent *midi_event =
-        dynamic_cast<const midi::MidiEvent*>(e);
-      if (meta_event) {
-        HandleMeta(meta_event, dyn_timing, time_shifted);
-      } else if (midi_event) {
-        HandleMidi(midi_event, dyn_timing, i, date_ms);
+    };
+    std::vector<std::thread> workers;
+    for (size_t c = 1; c < nchunks; ++c) {
+      workers.emplace_back(generate, c);
+    }
+    generate(0);
+    for (std::thread &w: workers) {
+      w.join();
+    }
+    const size_t nae = std::accumulate(chunks_events.begin(),
+      chunks_events.end(), abs_events_.size(),
+      [](size_t r, const abs_events_t &ae) { return r + ae.size(); });
+    abs_events_.reserve(nae);
+    for (size_t c = 0; c < nchunks; ++c) {
+      // Rebase sysex indices to the concatenated sysex_data_
+      const uint32_t sysex_base = sysex_data_.size();
+      for (AbsEvent &e: chunks_events[c]) {
+        if (e.kind_ == AbsEvent::SysEx) {
+          e.value_ += sysex_base;
+        }
       }
+      abs_events_.insert(abs_events_.end(),
+        chunks_events[c].begin(), chunks_events[c].end());
+      sysex_data_.insert(sysex_data_.end(),
+        chunks_sysex[c].begin(), chunks_sysex[c].end());
+      abs_events_t().swap(chunks_events[c]);
     }
+    next_iei_ = end_iei_;
+  }
+}
+
+void Player::HandleIndexEvent(
+    size_t i,
+    const TempoMap::Segment &segment,
+    abs_events_t &abs_events,
+    sysex_data_t &sysex_data) const {
+  const IndexEvent &ie = index_events_[i];
+  const uint32_t time_shifted = ShiftedTicks(i);
+  const uint32_t date_ms = tempo_map_.TicksToMs(segment, time_shifted);
+  const midi::Track &track = pm_.GetTracks()[ie.track_];
+  const midi::Event &e = track.events_[ie.tei_];
+  if (pp_.debug_ & 0x80) {
+    std::cout << fmt::format("[{:4}] time={} shifted={}, track_event={}\n",
+      i, ie.time_, time_shifted, track.EventStr(e));
   }
-  abs_events_.push_back(std::make_unique<FinalEvent>(
-    abs_events_.empty() ? 0 : abs_events_.back()->end_time_ms() + 1,
-    abs_events_.empty() ? 0 : abs_events_.back()->time_ms_original_ + 1));
-  if (pp_.debug_ & 0x4) {
-    const size_t nae = abs_events_.size();
-    std::cout << fmt::format("abs_events[{}]", nae) << "{\n";
-    for (size_t i = 0; i < nae; ++i) {
-      std::cout << fmt::format("  [{:4d}] {}\n", i, abs_events_[i]->str());
+  if (e.IsMidi()) {
+    HandleMidi(e, segment, i, date_ms, abs_events);
+  } else if (e.IsSysEx()) {
+    HandleSysEx(track, e, date_ms, abs_events, sysex_data);
+  }
+}
+
+// Producer thread. Pushes abs events to the ring, waiting while full.
+// If lazy, generates them a batch duration at a time, and drops the
+// pushed ones.
+void Player::Produce() {
+  size_t i = 0; // next to push, in abs_events_
+  bool done = false;
+  while (!done && !producer_stop_) {
+    if (pp_.lazy_ && (i == abs_events_.size()) && !abs_events_complete_) {
+      // Keep the last event, that dates the final event
+      const size_t n_drop = i > 0 ? i - 1 : 0;
+      abs_events_.erase(abs_events_.begin(), abs_events_.begin() + n_drop);
+      abs_base_ += n_drop;
+      i -= n_drop;
+      GenerateAbsEvents(uint64_t{pp_.batch_duration_ms_} +
+        (abs_events_.empty() ? 0 : abs_events_.back().time_ms_));
     }
-    std::cout << fmt::format("abs_events[{}]", nae) << "{\n";
+    while ((i < abs_events_.size()) && ring_.Push(abs_events_[i])) {
+      ++i;
+    }
+    done = abs_events_complete_ && (i == abs_events_.size());
+    if ((done || (i < abs_events_.size())) && !ring_filled_) {
+      ring_filled_ = true;
+      ring_filled_.notify_one();
+    }
+    if (!done && (i < abs_events_.size())) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  ring_filled_ = true;
+  ring_filled_.notify_one();
+}
+
+void Player::DumpAbsEvents(size_t from) const {
+  for (size_t i = from; i < abs_events_.size(); ++i) {
+    std::cout << fmt::format("  [{:4d}] {}\n",
+      abs_base_ + i, abs_events_[i].str());
   }
 }
 
@@ -448,60 +918,41 @@ void Player::play() {
   CallBackData cbd_final{CallBackData::CallBack::Final, this};
   seq_ids_[SeqIdFinal] = fluid_sequencer_register_client(
     ss_.sequencer_, "final", callback, &cbd_final);
+  CallBackData cbd_sysex{CallBackData::CallBack::SysEx, this};
+  seq_ids_[SeqIdSysEx] = fluid_sequencer_register_client(
+    ss_.sequencer_, "sysex", callback, &cbd_sysex);
   CallBackData cbd_progress{CallBackData::CallBack::Progress, this};
   if (pp_.progress_) {
     seq_ids_[SeqIdProgress] = fluid_sequencer_register_client(
       ss_.sequencer_, "progress", callback, &cbd_progress);
   }
+  std::thread producer(&Player::Produce, this);
+  ring_filled_.wait(false);
+  batches_ = SendBatches();
   SchedulePeriodicAt(0);
   if (pp_.progress_) {
     ScheduleProgressAt(100);
   }
   if (pp_.debug_ & 0x2) { std::cout << "wait on lock\n"; }
   cv_.wait(lock, [this]{ return final_handled_.load(); });
+  producer_stop_ = true;
+  producer.join();
   if (pp_.progress_) { std::cout << '\n'; }
+  if (pp_.debug_ & 0x8) {
+    std::cerr << fmt::format("{}\n", batch_stats_.str());
+  }
   if (pp_.debug_ & 0x2) { std::cout << "unlocked\n"; }
   ss_.DeleteFluidObjects();
 }
 
-void Player::SetVelocitiesMap() {
-  auto const &tmap = pp_.tracks_velocity_map_;
-  if (!tmap.empty()) {
-    if (pp_.debug_ & 0x1) {std::cerr<<fmt::format("#(tmap)={}\n", tmap.size());}
-    auto const channels_range = pm_.GetChannelsRange();
-    for (size_t ti = 0, nt = pm_.GetNumTracks(); ti < nt; ++ti) {
-      auto iter = tmap.find(ti);
-      if (iter != tmap.end()) {
-        const range_t orig_range = pm_.GetTracks()[ti].GetVelocityRange();
-        const range_t &target_range = iter->second;
-        tracks_velocity_map_.insert({ti, Affine{orig_range, target_range}});
-      }
-    }
-  }
-  auto const &cmap = pp_.channels_velocity_map_;
-  if (!cmap.empty()) {
-    if (pp_.debug_ & 0x1) {std::cerr<<fmt::format("#(cmap)={}\n", cmap.size());}
-    auto const channels_range = pm_.GetChannelsRange();
-    for (auto const &[channel, orig_range]: channels_range) {
-      auto iter = cmap.find(channel);
-      if (iter != cmap.end()) {
-        const range_t &target_range = iter->second;
-        channels_velocity_map_.insert(
-          {channel, Affine{orig_range, target_range}});
-      }
-    }
-  }
-}
-
 uint32_t Player::GetFirstNoteTime() {
   uint32_t t = 0;
   bool note_seen = false;
   const std::vector<midi::Track> &tracks = pm_.GetTracks();
   for (size_t i = 0; (i < index_events_.size()) && !note_seen; ++i) {
     const IndexEvent &ie = index_events_[i];
-    midi::Event *e = tracks[ie.track_].events_[ie.tei_].get();
-    midi::NoteOnEvent *note_on = dynamic_cast<midi::NoteOnEvent*>(e);
-    if (note_on) {
+    const midi::Event &e = tracks[ie.track_].events_[ie.tei_];
+    if (e.kind_ == midi::EventKind::NoteOn) {
       note_seen = true;
       t = ie.time_;
     }
@@ -509,119 +960,90 @@ uint32_t Player::GetFirstNoteTime() {
   return t;
 }
 
-void Player::HandleMeta(
-    const midi::MetaEvent* me,
-    DynamicTiming& dyn_timing,
-    uint32_t time_shifted) {
-  const midi::TempoEvent *tempo = dynamic_cast<const midi::TempoEvent*>(me);
-  if (tempo) {
-    dyn_timing.SetMicrosecondsPerQuarter(time_shifted, tempo->tttttt_);
-  }
-}
-
 void Player::HandleMidi(
-    const midi::MidiEvent* me,
-    DynamicTiming &dyn_timing,
+    const midi::Event& me,
+    const TempoMap::Segment &segment,
     size_t index_event_index,
-    uint32_t date_ms) {
+    uint32_t date_ms,
+    abs_events_t &abs_events) const {
   const bool after_begin = pp_.begin_ms_ <= date_ms;
   uint32_t date_ms_modified = after_begin
     ? FactorU32(pp_.tempo_div_factor_, date_ms - pp_.begin_ms_)
     : 0;
-  const midi::MidiVarByte vb = me->VarByte();
-  switch (vb) {
-   case midi::MidiVarByte::NOTE_OFF_x0: // handled by NOTE_ON
+  switch (me.kind_) {
+   case midi::EventKind::NoteOff: // handled by NoteOn
     break;
-   case midi::MidiVarByte::NOTE_ON_x1: {
-      const midi::NoteOnEvent *note_on =
-        dynamic_cast<const midi::NoteOnEvent*>(me);
-      if (after_begin && note_on->velocity_ != 0) {
-        uint32_t duration_ticks = GetNoteDuration(index_event_index, *note_on);
-        uint32_t duration_ms = dyn_timing.TicksToMs(duration_ticks);
-        uint32_t duration_modified =
-          FactorU32(pp_.tempo_div_factor_, duration_ms);
-        uint8_t key = static_cast<uint8_t>(int(note_on->key_) + pp_.key_shift_);
-        uint8_t itrack = index_events_[index_event_index].track_;
-        uint8_t velocity = MapVelocity(note_on, itrack);
-        abs_events_.push_back(std::make_unique<NoteEvent>(
-          date_ms_modified, date_ms,
-          note_on->channel_, key, velocity,
-          duration_modified, duration_ms));
+   case midi::EventKind::NoteOn: {
+      const midi::Event &note_on = me;
+      if (after_begin && note_on.Velocity() != 0) {
+        uint32_t duration_ticks = note_durations_[index_event_index];
+        uint32_t duration_ms = tempo_map_.SpanToMs(
+          segment, ShiftedTicks(index_event_index), duration_ticks);
+        AddNote(note_on, index_event_index, date_ms_modified, date_ms,
+          duration_ms, abs_events);
       }
     }
     break;
-   case midi::MidiVarByte::PROGRAM_CHANGE_x4: {
-      const midi::ProgramChangeEvent* pc =
-        dynamic_cast<const midi::ProgramChangeEvent*>(me);
-      abs_events_.push_back(std::make_unique<ProgramChange>(
-        date_ms_modified, date_ms, pc->channel_, pc->number_));
-    }
+   case midi::EventKind::ProgramChange:
+    abs_events.push_back(AbsEvent(AbsEvent::ProgramChange,
+      date_ms_modified, date_ms, me.channel_, me.Number()));
     break;
-   case midi::MidiVarByte::PITCH_WHEEL_x6: {
-      const midi::PitchWheelEvent* pw =
-        dynamic_cast<const midi::PitchWheelEvent*>(me);
-      abs_events_.push_back(std::make_unique<PitchWheel>(
-        date_ms_modified, date_ms, pw->channel_, pw->bend_));
-    }
+   case midi::EventKind::PitchWheel:
+    abs_events.push_back(AbsEvent(AbsEvent::PitchWheel,
+      date_ms_modified, date_ms, me.channel_, me.Bend()));
     break;
    default: // ignored
     break;
   }
 }
 
-uint32_t Player::GetNoteDuration(
-    size_t iei,
-    const midi::NoteOnEvent& note_on) const {
-  uint32_t curr_time = 0;
-  const std::vector<midi::Track> &tracks = pm_.GetTracks();
-  bool end_note_found = false;
-  for (size_t i = iei + 1; (i < index_events_.size()) && !end_note_found; ++i) {
-    const IndexEvent &ie = index_events_[i];
-    curr_time = ie.time_;
-    const midi::Event *e = tracks[ie.track_].events_[ie.tei_].get();
-    const midi::NoteOffEvent *note_off =
-      dynamic_cast<const midi::NoteOffEvent*>(e);
-    const midi::NoteOnEvent *note_on1 =
-      dynamic_cast<const midi::NoteOnEvent*>(e);
-    if (note_off) {
-      end_note_found = (note_off->channel_ == note_on.channel_) &&
-        (note_off->key_ == note_on.key_);
-    } else if (note_on1) {
-      end_note_found = (note_on1->velocity_ == 0) &&
-        (note_on1->channel_ == note_on.channel_) &&
-        (note_on1->key_ == note_on.key_);
-    }
-  }
-  uint32_t dur = curr_time - index_events_[iei].time_;
-  return dur;
-}
-
-uint8_t Player::MapVelocity(
-    const midi::NoteOnEvent *note_on,
-    uint8_t itrack) const {
-  uint8_t velocity = note_on->velocity_;
-  auto iter = channels_velocity_map_.find(note_on->channel_);
-  if (iter != channels_velocity_map_.end()) {
-    velocity = iter->second.Map(velocity);
-  } else {
-    iter = tracks_velocity_map_.find(itrack);
-    if (iter != tracks_velocity_map_.end()) {
-      velocity = iter->second.Map(velocity);
-    }
+void Player::HandleSysEx(
+    const midi::Track &track,
+    const midi::Event &sysex,
+    uint32_t date_ms,
+    abs_events_t &abs_events,
+    sysex_data_t &sysex_data) const {
+  // Only complete messages, F0 ... F7, are forwarded.
+  // Escaped (F7) packets and split messages are ignored.
+  std::span<const uint8_t> data = track.Payload(sysex);
+  if ((sysex.kind_ == midi::EventKind::SysEx) &&
+      !data.empty() && (data.back() == 0xf7)) {
+    const bool after_begin = pp_.begin_ms_ <= date_ms;
+    uint32_t date_ms_modified = after_begin
+      ? FactorU32(pp_.tempo_div_factor_, date_ms - pp_.begin_ms_)
+      : 0;
+    abs_events.push_back(AbsEvent(AbsEvent::SysEx,
+      date_ms_modified, date_ms, 0, sysex_data.size()));
+    sysex_data.push_back(data.first(data.size() - 1));
   }
-  return velocity;
 }
 
-void Player::ScheduleCallback(int seq_id, uint32_t at) {
-  fluid_event_t *e = new_fluid_event();
-  fluid_event_set_source(e, -1);
-  fluid_event_set_dest(e, seq_id);
-  fluid_event_timer(e, nullptr);
+void Player::AddNote(
+    const midi::Event &note_on,
+    size_t index_event_index,
+    uint32_t date_ms_modified,
+    uint32_t date_ms,
+    uint32_t duration_ms,
+    abs_events_t &abs_events) const {
+  uint8_t key = note_on.Key();
+  uint8_t velocity = note_on.Velocity();
+  if (note_transform_.Apply(index_events_[index_event_index].track_,
+      note_on.channel_, key, velocity)) {
+    uint32_t duration_modified =
+      FactorU32(pp_.tempo_div_factor_, duration_ms);
+    abs_events.push_back(AbsEvent(AbsEvent::Note,
+      date_ms_modified, date_ms, note_on.channel_, 0,
+      key, velocity, duration_modified));
+  }
+}
+
+void Player::ScheduleCallback(SeqId esi, uint32_t at) {
+  fluid_event_t *e = timer_events_[esi];
+  fluid_event_set_dest(e, seq_ids_[esi]);
   int send_rc = fluid_sequencer_send_at(ss_.sequencer_, e, at, 1);
   if (send_rc != FLUID_OK) {
     std::cerr << fmt::format("fluid_sequencer_send_at rc={}\n", send_rc);
   }
-  delete_fluid_event(e);
 }
 
 void Player::callback(
@@ -640,6 +1062,9 @@ void Player::callback(
    case CallBackData::CallBack::Progress:
     cbd->player_->progress_callback(time, event, seq);
     break;
+   case CallBackData::CallBack::SysEx:
+    cbd->player_->sysex_callback(time, event, seq);
+    break;
    default:
     std::cerr << "BUG: callback ecb=" << static_cast<int>(cbd->ecb_) << '\n';
   }  
@@ -649,28 +1074,77 @@ void Player::periodic_callback(
     unsigned int time,
     fluid_event_t *event,
     fluid_sequencer_t *seq) {
-  const std::lock_guard<std::mutex> lock(sending_mtx_);
-  const size_t nae = abs_events_.size();
-  bool batch_done = false;
-  uint32_t now = fluid_sequencer_get_tick(ss_.sequencer_);
-  uint32_t time_limit = (next_send_index_ < nae)
-    ? abs_events_[next_send_index_]->time_ms_ + pp_.batch_duration_ms_ : 0;
-  for (; (next_send_index_ < nae) && !batch_done; ++next_send_index_) {
-    if (next_send_index_ == 0) {
-      date_add_ms_ = now + pp_.initial_delay_ms_;
-      if (pp_.debug_ & 0x1) {
-        std::cerr << fmt::format("date_add_ms_={}\n", date_add_ms_);
+  if (batches_.Next()) {
+    SchedulePeriodicAt(batches_.Value());
+  }
+}
+
+// Sends a batch of events per resume, and yields the date of the next
+// periodic callback. Returns after the final event is sent.
+Generator<uint32_t> Player::SendBatches() {
+  // Batches of fewer events are sparse, and stretch the window
+  static constexpr size_t sparse_events = 0x100;
+  // Wake up lead_ms before the sent events run out.
+  const uint32_t lead_ms = pp_.batch_duration_ms_ / 2;
+  uint32_t window_ms = pp_.batch_duration_ms_; // adapted per batch
+  uint32_t last_sent_date_ms = 0;
+  bool final_sent = false;
+  while (!final_sent) {
+    const std::chrono::steady_clock::time_point t0 =
+      std::chrono::steady_clock::now();
+    size_t n_sent = 0;
+    bool batch_done = false;
+    bool capped = false;
+    const uint32_t now = fluid_sequencer_get_tick(ss_.sequencer_);
+    const AbsEvent *e = ring_.Front();
+    const uint32_t time_limit = e ? e->time_ms_ + window_ms : 0;
+    for (; e && !batch_done; e = ring_.Front()) {
+      if (date_add_ms_ == undated) {
+        date_add_ms_ = now + pp_.initial_delay_ms_;
+        if (pp_.debug_ & 0x1) {
+          std::cerr << fmt::format("date_add_ms_={}\n", date_add_ms_);
+        }
+      }
+      const uint32_t date_ms = e->time_ms_ + date_add_ms_;
+      SendFluidEvent(send_event_, *e, date_ms);
+      final_sent = (e->kind_ == AbsEvent::Final);
+      batch_done = (e->time_ms_ >= time_limit);
+      last_sent_date_ms = date_ms;
+      ring_.Pop();
+      ++n_sent;
+      if (!batch_done) {
+        // Capped events, even if already due, are sent on the next tick
+        capped = ((pp_.batch_max_events_ != 0) &&
+            (n_sent >= pp_.batch_max_events_)) ||
+          ((pp_.batch_budget_us_ != 0) &&
+            (MicrosecondsSince(t0) >= pp_.batch_budget_us_));
+        batch_done = capped;
       }
     }
-    AbsEvent *e = abs_events_[next_send_index_].get();
-    uint32_t date_ms = e->time_ms_ + date_add_ms_;
-    fluid_event_t *event = new_fluid_event();
-    e->SetSendFluidEvent(event, this, date_ms);
-    delete_fluid_event(event);
-    batch_done = (e->time_ms_ >= time_limit);
-  }
-  if (next_send_index_ < nae) {
-    SchedulePeriodicAt(now + pp_.batch_duration_ms_ / 2);
+    const uint32_t batch_window_ms = window_ms;
+    // Sparse batches stretch the window, up to 8 batch durations
+    if (!capped && (n_sent < sparse_events)) {
+      window_ms = std::min(2 * window_ms, 8 * pp_.batch_duration_ms_);
+    } else {
+      window_ms = pp_.batch_duration_ms_;
+    }
+    uint32_t next_ms = 0;
+    if (!final_sent) {
+      // If the producer lags, the ring may be empty
+      const uint32_t horizon_ms = date_add_ms_ != undated
+        ? std::max(now, last_sent_date_ms) : now;
+      next_ms = std::max(now + 1, horizon_ms - std::min(horizon_ms, lead_ms));
+    }
+    const uint64_t us = MicrosecondsSince(t0);
+    batch_stats_.Add(n_sent, us, capped);
+    if (pp_.debug_ & 0x8) {
+      std::cerr << fmt::format("batch: now={} events={} window={} "
+        "capped={} took={}us next={}\n",
+        now, n_sent, batch_window_ms, capped, us, next_ms);
+    }
+    if (!final_sent) {
+      co_yield next_ms;
+    }
   }
 }
 
@@ -697,8 +1171,16 @@ void Player::progress_callback(
     unsigned int time,
     fluid_event_t *event,
     fluid_sequencer_t *seq) {
-  if ((next_send_index_ > 0) && time >= date_add_ms_) {
-    const uint32_t last_ms = abs_events_.back()->time_ms_original_;
+  ShowProgress(time);
+  // about event 1/10 second
+  uint32_t tmod100 = time % 100;
+  uint32_t time_next = time + (tmod100 > 50 ? 200 : 100) - tmod100;
+  ScheduleProgressAt(time_next);
+}
+
+void Player::ShowProgress(uint32_t time) const {
+  if (time >= date_add_ms_) {
+    const uint32_t last_ms = last_ms_original_;
     uint32_t dt = time - date_add_ms_;
     float dt_div_f = dt / pp_.tempo_div_factor_; // save div in PlayParams ?
     uint32_t dt_div = static_cast<uint32_t>(dt_div_f);
@@ -711,10 +1193,285 @@ void Player::progress_callback(
       std::cout.flush();
     }
   }
-  // about event 1/10 second
-  uint32_t tmod100 = time % 100;
-  uint32_t time_next = time + (tmod100 > 50 ? 200 : 100) - tmod100;
-  ScheduleProgressAt(time_next);
+}
+
+void Player::sysex_callback(
+    unsigned int time,
+    fluid_event_t *event,
+    fluid_sequencer_t *seq) {
+  SendSysEx(reinterpret_cast<uintptr_t>(fluid_event_get_data(event)));
+}
+
+void Player::SendSysEx(size_t index) const {
+  const std::span<const uint8_t> data = sysex_data_[index];
+  int rc = fluid_synth_sysex(ss_.synth_,
+    reinterpret_cast<const char*>(data.data()), data.size(),
+    nullptr, nullptr, nullptr, 0);
+  if ((rc != FLUID_OK) && (pp_.debug_ & 0x2)) {
+    std::cerr << fmt::format("fluid_synth_sysex failed rc={}\n", rc);
+  }
+}
+
+void Player::SendFluidEvent(
+    fluid_event_t *event,
+    const AbsEvent &e,
+    uint32_t date_ms) {
+  fluid_event_set_source(event, -1);
+  int dest = seq_ids_[SeqIdSynth];
+  // event is reused, every kind sets its type and fields
+  switch (e.kind_) {
+   case AbsEvent::Note:
+    fluid_event_note(event, e.channel_, e.key_, e.velocity_, e.duration_ms_);
+    break;
+   case AbsEvent::ProgramChange:
+    fluid_event_program_change(event, e.channel_, e.value_);
+    break;
+   case AbsEvent::PitchWheel:
+    fluid_event_pitch_bend(event, e.channel_, e.value_);
+    break;
+   case AbsEvent::SysEx:
+    dest = seq_ids_[SeqIdSysEx];
+    fluid_event_timer(event, reinterpret_cast<void*>(uintptr_t{e.value_}));
+    break;
+   case AbsEvent::Final:
+    dest = seq_ids_[SeqIdFinal];
+    fluid_event_timer(event, nullptr);
+    break;
+  }
+  fluid_event_set_dest(event, dest);
+  fluid_sequencer_send_at(ss_.sequencer_, event, date_ms, 1);
+}
+
+// Abs events are generated and converted a batch duration at a time,
+// so they are not all kept along the direct events. Note offs are not
+// listed, NoteOn events have the samples of the notes, the offs are
+// queued while rendering. Zero length notes are kept one sample.
+void Player::SetDirectEvents() {
+  double sample_rate = sample_rate_;
+  fluid_settings_getnum(ss_.settings_, "synth.sample-rate", &sample_rate);
+  sample_rate_ = static_cast<uint32_t>(sample_rate);
+  internal_bufsize_ =
+    std::max(1, fluid_synth_get_internal_bufsize(ss_.synth_));
+  auto sample_at = [this](uint64_t ms) -> uint64_t {
+    return (ms + pp_.initial_delay_ms_) * sample_rate_ / 1000;
+  };
+  const std::vector<midi::Track> &tracks = pm_.GetTracks();
+  direct_events_.reserve(abs_events_.size() + 1 + std::count_if(
+    index_events_.begin() + next_iei_, index_events_.begin() + end_iei_,
+    [&tracks](const IndexEvent &ie) {
+      const midi::Event &e = tracks[ie.track_].events_[ie.tei_];
+      return ((e.kind_ == midi::EventKind::NoteOn) && (e.Velocity() != 0)) ||
+        (e.kind_ == midi::EventKind::ProgramChange) ||
+        (e.kind_ == midi::EventKind::PitchWheel) || e.IsSysEx();
+    }));
+  // Off samples of the sounding notes, to count the most sounding
+  std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<>> offs;
+  size_t max_sounding = 0;
+  size_t i = 0; // next to convert, in abs_events_
+  while (!abs_events_complete_ || (i < abs_events_.size())) {
+    for (; i < abs_events_.size(); ++i) {
+      const AbsEvent &e = abs_events_[i];
+      const uint64_t sample = sample_at(e.time_ms_);
+      switch (e.kind_) {
+       case AbsEvent::Note: {
+          const uint64_t samples = std::min<uint64_t>(
+            std::max<uint64_t>(1, sample_at(e.end_time_ms()) - sample),
+            std::numeric_limits<uint32_t>::max());
+          direct_events_.push_back(DirectEvent(DirectEvent::NoteOn, sample,
+            e.channel_, samples, e.key_, e.velocity_));
+          for (; !offs.empty() && (offs.top() <= sample); offs.pop()) {}
+          offs.push(sample + samples);
+          max_sounding = std::max(max_sounding, offs.size());
+        }
+        break;
+       case AbsEvent::ProgramChange:
+        direct_events_.push_back(DirectEvent(DirectEvent::ProgramChange,
+          sample, e.channel_, e.value_));
+        break;
+       case AbsEvent::PitchWheel:
+        direct_events_.push_back(DirectEvent(DirectEvent::PitchWheel,
+          sample, e.channel_, e.value_));
+        break;
+       case AbsEvent::SysEx:
+        direct_events_.push_back(DirectEvent(DirectEvent::SysEx,
+          sample, 0, e.value_));
+        break;
+       case AbsEvent::Final:
+        direct_events_.push_back(DirectEvent(DirectEvent::Final, sample));
+        break;
+      }
+    }
+    if (!abs_events_complete_) {
+      // Keep the last event, that dates the final event
+      const size_t n_drop = i > 0 ? i - 1 : 0;
+      abs_events_.erase(abs_events_.begin(), abs_events_.begin() + n_drop);
+      abs_base_ += n_drop;
+      i -= n_drop;
+      GenerateAbsEvents(uint64_t{pp_.batch_duration_ms_} +
+        (abs_events_.empty() ? 0 : abs_events_.back().time_ms_));
+    }
+  }
+  abs_events_ = abs_events_t();
+  // Abs events are generated in time order, so this is not expected
+  auto by_sample = [](const DirectEvent &e0, const DirectEvent &e1) {
+    return e0.sample_ < e1.sample_;
+  };
+  if (!std::is_sorted(direct_events_.begin(), direct_events_.end(),
+      by_sample)) {
+    std::stable_sort(direct_events_.begin(), direct_events_.end(),
+      by_sample);
+  }
+  // Reserved, so the render thread does not allocate
+  std::vector<DirectEvent> note_offs;
+  note_offs.reserve(max_sounding);
+  note_offs_ = decltype(note_offs_)(LaterSample(), std::move(note_offs));
+  if (pp_.debug_ & 0x1) {
+    std::cerr << fmt::format("direct events: {}, most sounding: {}, "
+      "sample rate: {}, internal block: {}\n", direct_events_.size(),
+      max_sounding, sample_rate_, internal_bufsize_);
+  }
+}
+
+// The audio driver calls render_callback, no sequencer is involved.
+void Player::PlayDirect() {
+  SetDirectEvents();
+  std::unique_lock lock(play_mtx_);
+  date_add_ms_ = pp_.initial_delay_ms_;
+  ss_.audio_driver_ =
+    new_fluid_audio_driver2(ss_.settings_, render_callback, this);
+  if (ss_.audio_driver_ == nullptr) {
+    std::cerr << "new_fluid_audio_driver2 failed\n";
+    rc_ = FLUID_FAILED;
+  } else {
+    while (!cv_.wait_for(lock, std::chrono::milliseconds(100),
+        [this]{ return final_handled_.load(); })) {
+      if (pp_.progress_) {
+        ShowProgress((rendered_samples_ * 1000) / sample_rate_);
+      }
+    }
+    if (pp_.progress_) { std::cout << '\n'; }
+  }
+  ss_.DeleteFluidObjects(); // stops rendering
+  if (pp_.debug_ & 0x8) {
+    const size_t ne = std::max<size_t>(1, batch_stats_.n_events_);
+    std::cerr << fmt::format("render: {}, sub-blocks={}, "
+      "timing error: mean={:.1f} max={} samples\n", batch_stats_.str(),
+      n_sub_blocks_, double(sum_error_samples_) / ne, max_error_samples_);
+  }
+}
+
+int Player::render_callback(
+    void *data,
+    int len,
+    int nfx,
+    float *fx[],
+    int nout,
+    float *out[]) {
+  return static_cast<Player*>(data)->Render(len, nfx, fx, nout, out);
+}
+
+// The earliest of the next direct event and the first queued note off.
+// At the same sample the note off, so a repeated key is not cut.
+const DirectEvent *Player::NextDirectEvent() const {
+  const DirectEvent *e = next_direct_ < direct_events_.size()
+    ? &direct_events_[next_direct_] : nullptr;
+  if (!note_offs_.empty() &&
+      ((e == nullptr) || (note_offs_.top().sample_ <= e->sample_))) {
+    e = &note_offs_.top();
+  }
+  return e;
+}
+
+// fluidsynth renders voices by whole internal blocks, so an event can
+// take effect only at their starts. The block is rendered in sub-blocks,
+// split at the internal block starts nearest to the events samples,
+// where the events are applied. With too many buffers to offset,
+// events are applied at the block start.
+int Player::Render(int len, int nfx, float *fx[], int nout, float *out[]) {
+  static constexpr int max_buffers = 0x20;
+  const std::chrono::steady_clock::time_point t0 =
+    std::chrono::steady_clock::now();
+  const uint64_t block_sample = rendered_samples_;
+  const uint64_t bufsize = internal_bufsize_;
+  const uint64_t half = bufsize / 2;
+  const bool split = (nfx <= max_buffers) && (nout <= max_buffers);
+  std::array<float*, max_buffers> fx_at, out_at;
+  size_t n_applied = 0;
+  int rc = FLUID_OK;
+  for (int offset = 0; (rc == FLUID_OK) && (offset < len); ) {
+    const uint64_t sample = block_sample + offset;
+    // Where the applied events take effect
+    const uint64_t effect = ((sample + bufsize - 1) / bufsize) * bufsize;
+    const DirectEvent *next = NextDirectEvent();
+    for (; (next != nullptr) && (next->sample_ < effect + half);
+        next = NextDirectEvent()) {
+      const DirectEvent e = *next;
+      if (e.kind_ == DirectEvent::NoteOff) {
+        note_offs_.pop();
+      } else {
+        ++next_direct_;
+        if (e.kind_ == DirectEvent::NoteOn) {
+          note_offs_.push(DirectEvent(DirectEvent::NoteOff,
+            e.sample_ + e.value_, e.channel_, 0, e.key_));
+        }
+      }
+      const uint64_t error =
+        e.sample_ < effect ? effect - e.sample_ : e.sample_ - effect;
+      sum_error_samples_ += error;
+      max_error_samples_ = std::max(max_error_samples_, error);
+      ApplyDirectEvent(e);
+      ++n_applied;
+    }
+    int n = len - offset;
+    if (split) {
+      if (next != nullptr) {
+        // First internal block start after sample_ - half
+        const uint64_t at = ((next->sample_ - half) / bufsize + 1) * bufsize;
+        n = std::min<uint64_t>(n, at - sample);
+      }
+      for (int i = 0; i < nfx; ++i) { fx_at[i] = fx[i] + offset; }
+      for (int i = 0; i < nout; ++i) { out_at[i] = out[i] + offset; }
+    }
+    rc = fluid_synth_process(ss_.synth_, n, nfx, split ? fx_at.data() : fx,
+      nout, split ? out_at.data() : out);
+    offset += n;
+    ++n_sub_blocks_;
+  }
+  rendered_samples_ = block_sample + len;
+  const uint64_t us = MicrosecondsSince(t0);
+  batch_stats_.Add(n_applied, us, false);
+  if ((pp_.debug_ & 0x8) && (n_applied > 0)) {
+    std::cerr << fmt::format("render: at={} events={} took={}us\n",
+      block_sample, n_applied, us);
+  }
+  return rc;
+}
+
+void Player::ApplyDirectEvent(const DirectEvent &e) {
+  switch (e.kind_) {
+   case DirectEvent::NoteOff:
+    fluid_synth_noteoff(ss_.synth_, e.channel_, e.key_);
+    break;
+   case DirectEvent::NoteOn:
+    fluid_synth_noteon(ss_.synth_, e.channel_, e.key_, e.velocity_);
+    break;
+   case DirectEvent::ProgramChange:
+    fluid_synth_program_change(ss_.synth_, e.channel_, e.value_);
+    break;
+   case DirectEvent::PitchWheel:
+    fluid_synth_pitch_bend(ss_.synth_, e.channel_, e.value_);
+    break;
+   case DirectEvent::SysEx:
+    SendSysEx(e.value_);
+    break;
+   case DirectEvent::Final:
+    if (!final_handled_.exchange(true)) {
+      // Locked, so the notification is not missed by PlayDirect
+      { const std::lock_guard<std::mutex> lock(play_mtx_); }
+      cv_.notify_one();
+    }
+    break;
+  }
 }
 
 uint32_t Player::FactorU32(double f, uint32_t u) {
@@ -730,42 +1487,6 @@ uint32_t Player::FactorU32(double f, uint32_t u) {
   return ret;
 }
 
-// Now that Player is defined, we can define Handle virtual methods
-void NoteEvent::SetSendFluidEvent(
-    fluid_event_t *event, const Player *player, uint32_t date_ms) {
-  fluid_event_set_source(event, -1);
-  fluid_event_set_dest(event, player->GetSeqId(Player::SeqIdSynth));
-  fluid_event_note(event, channel_, key_, velocity_, duration_ms_);
-  fluid_sequencer_send_at(
-    player->GetSynthSequencer().sequencer_, event, date_ms, 1);
-}
-
-void ProgramChange::SetSendFluidEvent(
-    fluid_event_t *event, const Player *player, uint32_t date_ms) {
-  fluid_event_set_source(event, -1);
-  fluid_event_set_dest(event, player->GetSeqId(Player::SeqIdSynth));
-  fluid_event_program_change(event, channel_, program_);
-  fluid_sequencer_send_at(
-    player->GetSynthSequencer().sequencer_, event, date_ms, 1);
-}
-
-void PitchWheel::SetSendFluidEvent(
-    fluid_event_t *event, const Player *player, uint32_t date_ms) {
-  fluid_event_set_source(event, -1);
-  fluid_event_set_dest(event, player->GetSeqId(Player::SeqIdSynth));
-  fluid_event_pitch_bend(event, channel_, bend_);
-  fluid_sequencer_send_at(
-    player->GetSynthSequencer().sequencer_, event, date_ms, 1);
-}
-
-void FinalEvent::SetSendFluidEvent(
-    fluid_event_t *event, const Player *player, uint32_t date_ms) {
-  fluid_event_set_source(event, -1);
-  fluid_event_set_dest(event, player->GetSeqId(Player::SeqIdFinal));
-  fluid_sequencer_send_at(
-    player->GetSynthSequencer().sequencer_, event, date_ms, 1);
-}
-
 ////////////////////////////////////////////////////////////////////////
 
 int play(
@@ -2,6 +2,7 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 #include "options.h"
 #include "midi.h"
 
@@ -14,9 +15,18 @@ class PlayParams {
   unsigned tuning_{440};
   Options::k2range_t tracks_velocity_map_;
   Options::k2range_t channels_velocity_map_;
+  std::vector<unsigned> muted_tracks_;
+  std::vector<unsigned> muted_channels_;
+  std::vector<unsigned> solo_tracks_; // if not empty, only these are played
+  std::vector<unsigned> solo_channels_; // as above
   uint32_t initial_delay_ms_{0};
   uint32_t batch_duration_ms_{0};
+  uint32_t batch_max_events_{0}; // 0 for no cap
+  uint32_t batch_budget_us_{0}; // of a periodic callback, 0 for no cap
   bool progress_{false};
+  bool lazy_{false}; // abs events generated per batch
+  bool direct_{false}; // own audio rendering, no sequencer
+  unsigned threads_{1}; // for abs events generation, if not lazy
   uint32_t debug_{0};
 };
 
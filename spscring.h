@@ -0,0 +1,53 @@
+// -*- c++ -*-
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <vector>
+
+// Bounded lock-free queue of one producer thread and one consumer thread.
+// Capacity is rounded up to a power of 2.
+// Each side caches the other side's index, and re-reads it only when
+// the queue seems full (producer) or empty (consumer).
+template <typename T>
+class SpscRing {
+ public:
+  SpscRing(size_t capacity) :
+    buffer_(std::bit_ceil(capacity)), mask_{buffer_.size() - 1} {}
+  // Producer. False if full
+  bool Push(const T &v) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    bool ok = (tail - head_cache_ < buffer_.size());
+    if (!ok) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      ok = (tail - head_cache_ < buffer_.size());
+    }
+    if (ok) {
+      buffer_[tail & mask_] = v;
+      tail_.store(tail + 1, std::memory_order_release);
+    }
+    return ok;
+  }
+  // Consumer. nullptr if empty, otherwise valid until Pop()
+  const T *Front() {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+    }
+    return head != tail_cache_ ? &buffer_[head & mask_] : nullptr;
+  }
+  // Consumer, after a non null Front()
+  void Pop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+      std::memory_order_release);
+  }
+ private:
+  static constexpr size_t cache_line = 64;
+  std::vector<T> buffer_;
+  const size_t mask_;
+  alignas(cache_line) std::atomic<size_t> tail_{0};
+  size_t head_cache_{0}; // of the producer
+  alignas(cache_line) std::atomic<size_t> head_{0};
+  size_t tail_cache_{0}; // of the consumer
+};
@@ -5,7 +5,8 @@
 
 SynthSequencer::SynthSequencer(
     const std::string &sound_font_path,
-    uint32_t debug) : 
+    uint32_t debug,
+    bool direct) : 
     debug_{debug} {
   settings_ = new_fluid_settings();
   int fs_rc;
@@ -34,10 +35,10 @@ SynthSequencer::SynthSequencer(
       error_ = fmt::format("failed: sfload({})", sound_font_path);
     }
   }
-  if (ok()) {
+  if (ok() && !direct) {
     audio_driver_ = new_fluid_audio_driver(settings_, synth_);
   }
-  if (ok()) {
+  if (ok() && !direct) {
     sequencer_ = new_fluid_sequencer2(0);
     synth_seq_id_ = fluid_sequencer_register_fluidsynth(sequencer_, synth_);
   }
@@ -7,7 +7,12 @@
 
 class SynthSequencer {
  public:
-  SynthSequencer(const std::string &sound_font_path, uint32_t debug);
+  // direct: no audio driver nor sequencer, the synth is rendered by
+  // the caller, that may set audio_driver_ to be deleted here.
+  SynthSequencer(
+    const std::string &sound_font_path,
+    uint32_t debug,
+    bool direct=false);
   ~SynthSequencer();
   bool ok() const { return error_.empty(); }
   void DeleteFluidObjects();
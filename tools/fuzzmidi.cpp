@@ -0,0 +1,17 @@
+// libFuzzer (or AFL++ in libFuzzer mode) target over the midi parser.
+// Build with: cmake -DCMAKE_CXX_COMPILER=clang++ -DMODIMIDI_FUZZ=ON
+#include <cstddef>
+#include <cstdint>
+#include "midi.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  midi::Midi midi(data, size);
+  if (midi.Valid()) {
+    for (const midi::Track &track: midi.GetTracks()) {
+      for (const midi::Event &e: track.events_) {
+        track.EventStr(e);
+      }
+    }
+  }
+  return 0;
+}